@@ -0,0 +1,203 @@
+//==================================================================
+/// ScenarioBank.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef SCENARIOBANK_H
+#define SCENARIOBANK_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#if !defined(_WIN32)
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+#include "Simulation.h"
+
+//==================================================================
+// A file with the NPCs of a range of seeds, ready to be used as they
+//  are: the file is mapped in memory and the ScenarioTraffic of each
+//  seed points into it, so thousands of seeds load at no cost.
+// The header has the ScenarioTraffic::CalcGenHash() of the writer, a
+//  file made with other generation parameters is rejected.
+// Layout (native endianness):
+//  Header, then seedsN+1 offsets (uint32_t, in NPCs, the last is the
+//  total), then all the NPCs (ScenarioTraffic::NPC)
+class ScenarioBank
+{
+    using NPC = ScenarioTraffic::NPC;
+
+    struct Header
+    {
+        char        magic[4];
+        uint32_t    version;
+        uint32_t    firstSeed;
+        uint32_t    seedsN;
+        uint64_t    genHash;
+    };
+    static constexpr char       MAGIC[4] = {'T','F','S','B'};
+    static constexpr uint32_t   VERSION = 2;
+
+    const uint8_t*          mpData {};
+    size_t                  mDataSize {};
+#if defined(_WIN32)
+    std::vector<uint8_t>    mFileData;
+#endif
+    uint32_t                mFirstSeed {};
+    uint32_t                mSeedsN {};
+    const uint32_t*         mpOffs {};
+    const NPC*              mpNPCs {};
+
+    struct PrivateTag {};
+
+public:
+    ScenarioBank(PrivateTag) {}
+
+    ScenarioBank(const ScenarioBank&) = delete;
+    ScenarioBank& operator=(const ScenarioBank&) = delete;
+
+    ~ScenarioBank()
+    {
+#if !defined(_WIN32)
+        if (mpData)
+            munmap((void*)mpData, mDataSize);
+#endif
+    }
+
+    // generate the scenarios of [firstSeed, firstSeed+seedsN) and save them
+    static void Write(const std::string& path, uint32_t firstSeed, uint32_t seedsN)
+    {
+        std::vector<uint32_t> offs { 0 };
+        std::vector<NPC> npcs;
+        for (uint32_t i=0; i < seedsN; ++i)
+        {
+            const ScenarioTraffic traffic(firstSeed + i);
+            for (size_t j=0; j < traffic.GetNPCsN(); ++j)
+                npcs.push_back(traffic.GetNPC(j));
+            offs.push_back((uint32_t)npcs.size());
+        }
+
+        Header head {};
+        std::memcpy(head.magic, MAGIC, sizeof(MAGIC));
+        head.version = VERSION;
+        head.firstSeed = firstSeed;
+        head.seedsN = seedsN;
+        head.genHash = ScenarioTraffic::CalcGenHash();
+
+        auto* pFile = fopen(path.c_str(), "wb");
+        if (!pFile)
+            throw std::runtime_error("Could not create " + path);
+
+        const bool ok =
+            fwrite(&head, sizeof(head), 1, pFile) == 1 &&
+            fwrite(offs.data(), sizeof(uint32_t), offs.size(), pFile) == offs.size() &&
+            fwrite(npcs.data(), sizeof(NPC), npcs.size(), pFile) == npcs.size();
+
+        if (fclose(pFile) != 0 || !ok)
+            throw std::runtime_error("Could not write " + path);
+    }
+
+    // map the file, and have ScenarioTraffic::Get() use its scenarios
+    static std::shared_ptr<const ScenarioBank> Load(const std::string& path)
+    {
+        auto pBank = std::make_shared<ScenarioBank>(PrivateTag());
+        pBank->mapFile(path);
+        pBank->parse(path);
+
+        for (uint32_t i=0; i < pBank->mSeedsN; ++i)
+        {
+            const auto off = pBank->mpOffs[i];
+            ScenarioTraffic::SetCached(
+                pBank->mFirstSeed + i,
+                std::make_shared<const ScenarioTraffic>(
+                    pBank->mpNPCs + off,
+                    pBank->mpOffs[i+1] - off,
+                    pBank));
+        }
+        return pBank;
+    }
+
+    uint32_t GetFirstSeed() const { return mFirstSeed; }
+    uint32_t GetSeedsN() const { return mSeedsN; }
+
+private:
+    void mapFile(const std::string& path)
+    {
+#if defined(_WIN32)
+        auto* pFile = fopen(path.c_str(), "rb");
+        if (!pFile)
+            throw std::runtime_error("Could not open " + path);
+
+        fseek(pFile, 0, SEEK_END);
+        mFileData.resize((size_t)ftell(pFile));
+        fseek(pFile, 0, SEEK_SET);
+        const bool ok = fread(mFileData.data(), 1, mFileData.size(), pFile) == mFileData.size();
+        fclose(pFile);
+        if (!ok)
+            throw std::runtime_error("Could not read " + path);
+
+        mpData = mFileData.data();
+        mDataSize = mFileData.size();
+#else
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open " + path);
+
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            close(fd);
+            throw std::runtime_error("Could not read " + path);
+        }
+        auto* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping stays valid
+        if (p == MAP_FAILED)
+            throw std::runtime_error("Could not map " + path);
+
+        mpData = (const uint8_t*)p;
+        mDataSize = (size_t)st.st_size;
+#endif
+    }
+
+    void parse(const std::string& path)
+    {
+        auto fail = [&](){ throw std::runtime_error("Bad scenario bank " + path); };
+
+        Header head {};
+        if (mDataSize < sizeof(head))
+            fail();
+        std::memcpy(&head, mpData, sizeof(head));
+        if (std::memcmp(head.magic, MAGIC, sizeof(MAGIC)) || head.version != VERSION)
+            fail();
+        if (head.genHash != ScenarioTraffic::CalcGenHash())
+            throw std::runtime_error("Stale scenario bank " + path + ", generated with other parameters");
+
+        const auto offsSize = ((size_t)head.seedsN + 1) * sizeof(uint32_t);
+        if (mDataSize < sizeof(head) + offsSize)
+            fail();
+
+        mFirstSeed = head.firstSeed;
+        mSeedsN    = head.seedsN;
+        mpOffs     = (const uint32_t*)(mpData + sizeof(head));
+        mpNPCs     = (const NPC*)(mpData + sizeof(head) + offsSize);
+
+        // offsets must grow and stay in the file
+        const auto npcsN = (mDataSize - sizeof(head) - offsSize) / sizeof(NPC);
+        if (mpOffs[0] != 0)
+            fail();
+        for (uint32_t i=0; i < mSeedsN; ++i)
+            if (mpOffs[i+1] < mpOffs[i] || mpOffs[i+1] > npcsN)
+                fail();
+    }
+};
+
+#endif
@@ -0,0 +1,137 @@
+//==================================================================
+/// SimBatch.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef SIMBATCH_H
+#define SIMBATCH_H
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <cassert>
+#include "Simulation.h"
+
+//==================================================================
+// Runs a set of simulations driven by the same net in lockstep (e.g. all
+//  the training seeds of a network). At each step the sensors of the
+//  running simulations are gathered as the rows of a matrix, the net is
+//  run once on the whole batch, and the controls are scattered back.
+// Finished simulations are compacted out, so the batch stays dense.
+// With a net built from parameters (packed weights), ForwardPassBatch()
+//  gives the same results as one ForwardPass() per row.
+// Reset() starts a new set of seeds on the same simulations, so a batch
+//  can be reused (e.g. per thread) without allocating.
+class SimBatch
+{
+    using Sim = Simulation;
+
+    const SimpleNN* const           mpNNet;
+    const SimLimits                 mLimits;
+    const SimStepping               mStepping;
+    // the first mSimsN are in use, the others are kept for later
+    std::vector<std::unique_ptr<Sim>> mSims;
+    size_t                          mSimsN {};
+    // the running simulations, in the order of mSims
+    std::vector<Sim*>               mpActives;
+    // batch matrices, a row per running simulation
+    std::vector<float>              mInsData;
+    std::vector<float>              mOutsData;
+
+public:
+    SimBatch(
+            const SimpleNN* pNNet,
+            const SimLimits& limits={},
+            const SimStepping& stepping={})
+        : mpNNet(pNNet)
+        , mLimits(limits)
+        , mStepping(stepping)
+    {}
+
+    SimBatch(
+            const SimpleNN* pNNet,
+            const uint32_t* pSeeds,
+            size_t seedsN,
+            const SimLimits& limits={},
+            const SimStepping& stepping={})
+        : SimBatch(pNNet, limits, stepping)
+    {
+        Reset(pSeeds, seedsN);
+    }
+
+    // start over with a simulation per seed
+    void Reset(const uint32_t* pSeeds, size_t seedsN)
+    {
+        for (size_t i=0; i < seedsN; ++i)
+        {
+            if (i < mSims.size())
+                mSims[i]->Reset(pSeeds[i]);
+            else
+                mSims.push_back(std::make_unique<Sim>(pSeeds[i], mpNNet, mLimits, mStepping));
+        }
+        mSimsN = seedsN;
+
+        mpActives.clear();
+        for (size_t i=0; i < mSimsN; ++i)
+            if (mSims[i]->IsSimRunning())
+                mpActives.push_back(mSims[i].get());
+
+        if (mInsData.size() < seedsN * Vehicle::SENS_N)
+        {
+            mInsData.resize(seedsN * Vehicle::SENS_N);
+            mOutsData.resize(seedsN * Vehicle::CTRL_N);
+        }
+    }
+
+    // one step for all the running simulations
+    void AnimateSims(float dt)
+    {
+        const auto n = mpActives.size();
+        if (!n)
+            return;
+
+        auto ins  = Tensor(n, Vehicle::SENS_N, mInsData.data(), false);
+        auto outs = Tensor(n, Vehicle::CTRL_N, mOutsData.data(), false);
+
+        // gather
+        for (size_t i=0; i < n; ++i)
+        {
+            auto* pSim = mpActives[i];
+            pSim->BeginStep();
+            const auto* pSens = pSim->GetSensors();
+            std::copy(pSens, pSens + Vehicle::SENS_N, ins[i]);
+        }
+
+        mpNNet->ForwardPassBatch(outs, ins);
+
+        // scatter and step, keep only those still running
+        size_t keptN = 0;
+        for (size_t i=0; i < n; ++i)
+        {
+            auto* pSim = mpActives[i];
+            std::copy(outs[i], outs[i] + Vehicle::CTRL_N, pSim->GetControls());
+            pSim->EndStep(dt);
+            if (pSim->IsSimRunning())
+                mpActives[keptN++] = pSim;
+        }
+        mpActives.resize(keptN);
+    }
+
+    // step until all are done, or a shutdown is requested
+    void RunToEnd(float dt, const std::atomic<bool>& reqShutdown)
+    {
+        while (IsRunning() && !reqShutdown)
+            AnimateSims(dt);
+    }
+
+    bool IsRunning() const { return !mpActives.empty(); }
+    size_t GetActiveN() const { return mpActives.size(); }
+
+    size_t GetSimsN() const { return mSimsN; }
+    const Sim& GetSim(size_t i) const { assert(i < mSimsN); return *mSims[i]; }
+};
+
+#endif
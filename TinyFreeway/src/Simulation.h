@@ -13,6 +13,12 @@
 #include <vector>
 #include <algorithm>
 #include <random>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
 #include <cassert>
 #include "DBase.h"
 #include "MathBase.h"
@@ -38,6 +44,8 @@ static constexpr auto SLAB_WIDTH = ROAD_LANE_WIDTH * ROAD_LANES_N;
 static constexpr auto SLAB_MAX_N   = (size_t)(ROAD_LEN_M        / SLAB_DEPTH);
 static constexpr auto SLAB_STA_IDX = (size_t)(              10  / SLAB_DEPTH);
 static constexpr auto SLAB_END_IDX = (size_t)((ROAD_LEN_M - 10) / SLAB_DEPTH);
+// the z of the vehicles wraps after this (see Vehicle::handleWrapping())
+static constexpr auto TRACK_LEN_M  = SLAB_DEPTH * (SLAB_MAX_N - 1);
 
 // vehicle params
 static constexpr auto VH_MAX_SPEED_MS   = 40.f; // meters/second
@@ -64,6 +72,7 @@ static auto attenuateVal = [](auto val, auto dt, auto att)
 };
 
 //==================================================================
+// Our vehicle, driven by the net (the NPCs are in NPCArrays)
 class Vehicle
 {
 public:
@@ -115,8 +124,6 @@ public:
     float       mBrake = 0;
     float       mYawAng = 0;
 
-    bool        mIsNPC = true;
-
     //
     void ApplyControls(float dt)
     {
@@ -128,14 +135,6 @@ public:
 
     void AnimateVehicle(float dt)
     {
-        // NPCs just go forward
-        if (mIsNPC)
-        {
-            mPos[2] += -mSpeed * dt;
-            handleWrapping();
-            return;
-        }
-
         mSpeed += mAccel * dt;
         mSpeed += mBrake * dt; // will clamp to 0 below
 
@@ -211,6 +210,393 @@ private:
 #endif
 };
 
+//==================================================================
+static size_t calcLaneIdx(float x)
+{
+    const auto laneWidth = SLAB_WIDTH / (float)ROAD_LANES_N;
+    const auto laneIdx = (size_t)((x + SLAB_WIDTH * 0.5f) / laneWidth);
+    return std::clamp(laneIdx, (size_t)0, (size_t)(ROAD_LANES_N-1));
+}
+
+//==================================================================
+// The NPCs of a scenario. They only depend on the seed, and they don't
+//  react to anything: they go straight at constant speed, so where they
+//  are at any time is computed directly from the start.
+// Read-only, built once per seed and shared by all the simulations of
+//  that seed, see Get(). The NPCs may also point into a ScenarioBank.
+class ScenarioTraffic
+{
+public:
+    struct NPC
+    {
+        float   x;
+        float   startZ;
+        float   speed; // 0 is stranded
+    };
+    static_assert(sizeof(NPC) == 3 * sizeof(float), "Stored as is in the bank files");
+
+private:
+    std::vector<NPC>        mOwnNPCs;
+    const NPC*              mpNPCs {};
+    size_t                  mNPCsN {};
+    // the owner of the NPCs data, when it's not us
+    std::shared_ptr<const void> mpOwner;
+
+public:
+    // generate from the seed
+    explicit ScenarioTraffic(uint32_t seed)
+    {
+        // where our vehicle starts
+        const auto ourPos = Float3(0, VH_ELEVATION, SLAB_STA_IDX * -SLAB_DEPTH);
+
+        // random gen and distribution
+        std::mt19937 gen(seed);
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+
+        // generate some NPC vehicles
+        for (size_t i=0; i < NPC_SPAWN_N; ++i)
+        {
+            auto pos = Float3(0, VH_ELEVATION, 0);
+            float speed = 0;
+
+            // random distance for the extent of the road
+            pos[2] = dist(gen) * -ROAD_LEN_M;
+
+            if (dist(gen) < NPC_STRANDED_P)
+            {
+                // right att he edge of the road, left or right
+                pos[0] = (dist(gen) < 0.5f) ? -SLAB_WIDTH * 0.5f : SLAB_WIDTH * 0.5f;
+                speed = 0; // speed == 0 -> stranded
+            }
+            else
+            {
+                // random x at center of each lane, based on ROAD_LANES_N
+                const auto laneW = SLAB_WIDTH / ROAD_LANES_N;
+                const auto lane = floor( dist(gen) * (ROAD_LANES_N-1) + 0.5f );
+                const auto x = lane * laneW - SLAB_WIDTH * 0.5f + laneW * 0.5f;
+
+                pos[0] = x;
+                speed = glm::mix(NPC_SPEED_MIN_MS, NPC_SPEED_MAX_MS, dist(gen));
+            }
+
+            // reject if the starting position is too close to our vehicle
+            if (glm::distance(pos, ourPos) < NPC_MIN_SPAWN_R)
+                continue;
+
+            // if they are very close and on the same lane
+            if (std::abs(pos[2] - ourPos[2]) < NPC_MIN_SPAWN_ZDIST &&
+                    calcLaneIdx(pos[0]) == calcLaneIdx(ourPos[0]))
+                continue;
+
+            mOwnNPCs.push_back({pos[0], pos[2], speed});
+        }
+        mpNPCs = mOwnNPCs.data();
+        mNPCsN = mOwnNPCs.size();
+    }
+
+    // NPCs that belong to pOwner (e.g. a mapped file)
+    ScenarioTraffic(const NPC* pNPCs, size_t npcsN, std::shared_ptr<const void> pOwner)
+        : mpNPCs(pNPCs)
+        , mNPCsN(npcsN)
+        , mpOwner(std::move(pOwner))
+    {}
+
+    ScenarioTraffic(const ScenarioTraffic&) = delete;
+    ScenarioTraffic& operator=(const ScenarioTraffic&) = delete;
+
+    size_t GetNPCsN() const { return mNPCsN; }
+    const NPC& GetNPC(size_t i) const { assert(i < mNPCsN); return mpNPCs[i]; }
+
+    // hash of what the generation depends on, to tell when stored
+    //  scenarios are stale. The constants, plus the NPCs of a reference
+    //  seed for what they don't cover (the sampling code, the standard
+    //  library's distributions)
+    static uint64_t CalcGenHash()
+    {
+        // FNV-1a
+        uint64_t h = 14695981039346656037ull;
+        auto add = [&](const void* p, size_t size)
+        {
+            for (size_t i=0; i < size; ++i)
+                h = (h ^ ((const uint8_t*)p)[i]) * 1099511628211ull;
+        };
+        auto addVal = [&](auto v){ add(&v, sizeof(v)); };
+
+        addVal((uint64_t)NPC_SPAWN_N);
+        addVal(NPC_SPEED_MIN_MS);
+        addVal(NPC_SPEED_MAX_MS);
+        addVal(NPC_STRANDED_P);
+        addVal(NPC_MIN_SPAWN_R);
+        addVal(NPC_MIN_SPAWN_ZDIST);
+        addVal(ROAD_LEN_M);
+        addVal((uint32_t)ROAD_LANES_N);
+        addVal(SLAB_WIDTH);
+        addVal(SLAB_DEPTH);
+        addVal((uint64_t)SLAB_STA_IDX);
+        addVal(VH_ELEVATION);
+
+        const ScenarioTraffic ref(0);
+        add(ref.mpNPCs, ref.mNPCsN * sizeof(NPC));
+        return h;
+    }
+
+    // the scenario of a seed, built on the first request. Up to
+    //  CACHE_MAX_N generated ones are kept, then they're dropped all at
+    //  once (the simulations hold on to the ones they use)
+    static constexpr size_t CACHE_MAX_N = 1024;
+
+    static std::shared_ptr<const ScenarioTraffic> Get(uint32_t seed)
+    {
+        auto& c = getCache();
+        std::lock_guard<std::mutex> lock(c.mMutex);
+        if (auto it = c.mSetMap.find(seed); it != c.mSetMap.end())
+            return it->second;
+
+        if (auto it = c.mGenMap.find(seed); it != c.mGenMap.end())
+            return it->second;
+
+        if (c.mGenMap.size() >= CACHE_MAX_N)
+            c.mGenMap.clear();
+
+        auto p = std::make_shared<const ScenarioTraffic>(seed);
+        c.mGenMap[seed] = p;
+        return p;
+    }
+
+    // to be returned by Get() from now on (e.g. loaded from a bank),
+    //  these are never dropped
+    static void SetCached(uint32_t seed, std::shared_ptr<const ScenarioTraffic> p)
+    {
+        auto& c = getCache();
+        std::lock_guard<std::mutex> lock(c.mMutex);
+        c.mGenMap.erase(seed);
+        c.mSetMap[seed] = std::move(p);
+    }
+
+private:
+    using Map = std::unordered_map<uint32_t, std::shared_ptr<const ScenarioTraffic>>;
+    struct Cache
+    {
+        std::mutex  mMutex;
+        Map         mSetMap;
+        Map         mGenMap;
+    };
+    static Cache& getCache()
+    {
+        static Cache sCache;
+        return sCache;
+    }
+};
+
+//==================================================================
+// z at a given time of an NPC going at constant speed, wrapped in the
+//  track as Vehicle::handleWrapping() would do step by step.
+//  z is never positive, so the int conversion is a floor, and the whole
+//  thing has no branches, to be vectorized in loops
+inline float calcNPCZ(float startZ, float speed, float timeS)
+{
+    const auto z = startZ - speed * timeS;
+    return z + TRACK_LEN_M * (float)(int)(z * (-1.f / TRACK_LEN_M));
+}
+
+//==================================================================
+// yaw of the NPCs at a given time. They get no steering, and a steering of
+//  0 is full left in Vehicle::ApplyControls(), with no clamp for NPCs, so
+//  the yaw drifts at the same rate for all of them. It only shows in the
+//  probes' yaw sensor, their direction is still straight along -z
+inline float calcNPCYaw(float timeS)
+{
+    return -0.5f * VH_YAW_MAX_RAD * timeS;
+}
+
+//==================================================================
+// The NPCs, as one array per field, so that the per-step update and the
+//  scans over all of them are plain SIMD loops on just the data they need.
+// They all have y = VH_ELEVATION, and the same yaw.
+struct NPCArrays
+{
+    std::vector<float>  mX;
+    std::vector<float>  mZ;
+    std::vector<float>  mStartZ;
+    std::vector<float>  mSpeed; // 0 is stranded
+    float               mYawAng {};
+
+    size_t size() const { return mX.size(); }
+
+    void SetFromTraffic(const ScenarioTraffic& traffic)
+    {
+        // room for any scenario, so that switching scenario doesn't allocate
+        const auto n = traffic.GetNPCsN();
+        reserve(std::max(n, NPC_SPAWN_N));
+
+        mX.resize(n);
+        mZ.resize(n);
+        mStartZ.resize(n);
+        mSpeed.resize(n);
+        mYawAng = 0;
+        for (size_t i=0; i < n; ++i)
+        {
+            const auto& npc = traffic.GetNPC(i);
+            mX[i] = npc.x;
+            mZ[i] = npc.startZ;
+            mStartZ[i] = npc.startZ;
+            mSpeed[i] = npc.speed;
+        }
+    }
+
+    // where they are at the given time
+    void UpdateZ(float timeS)
+    {
+        mYawAng = calcNPCYaw(timeS);
+
+        const auto n = size();
+        auto* __restrict pZ = mZ.data();
+        const auto* __restrict pStaZ = mStartZ.data();
+        const auto* __restrict pSpeed = mSpeed.data();
+        for (size_t i=0; i < n; ++i)
+            pZ[i] = calcNPCZ(pStaZ[i], pSpeed[i], timeS);
+    }
+
+    Float3 GetPos(size_t i) const { return {mX[i], VH_ELEVATION, mZ[i]}; }
+
+private:
+    void reserve(size_t n)
+    {
+        mX.reserve(n);
+        mZ.reserve(n);
+        mStartZ.reserve(n);
+        mSpeed.reserve(n);
+    }
+};
+
+//==================================================================
+// The NPCs bucketed by z, in cells as long as the probe radius along the
+//  track, so that probing and collisions only visit the few that are
+//  near, however many there are on the road.
+// The cells are in one array (CSR layout): the NPCs of cell c are
+//  mIdxs[mCellStarts[c] .. mCellStarts[c+1]), so the memory is
+//  CELLS_N + 2 * N, and a range of cells is one span.
+// Build() sorts all the NPCs by cell. Update() moves only those that
+//  changed cell, one cell boundary at a time: the NPC is swapped to the
+//  edge of its span and the boundary moves past it. The order within a
+//  cell then depends on the moves, the users don't depend on it.
+class NPCGrid
+{
+    static constexpr auto CELL_LEN = VH_PROBE_RADIUS;
+    static constexpr auto CELLS_N  = (size_t)(TRACK_LEN_M / CELL_LEN) + 1;
+
+    std::vector<uint32_t>   mCellStarts; // CELLS_N + 1, into mIdxs
+    std::vector<uint32_t>   mIdxs;       // NPC indices, by cell
+    std::vector<uint32_t>   mNPCCell;    // cell of each NPC
+
+public:
+    void Build(const NPCArrays& npcs)
+    {
+        // room for any scenario, as in NPCArrays, so that a reset with
+        //  another seed doesn't allocate
+        const auto n = npcs.size();
+        const auto capN = std::max(n, NPC_SPAWN_N);
+        mCellStarts.resize(CELLS_N + 1);
+        mIdxs.reserve(capN);
+        mNPCCell.reserve(capN);
+        mIdxs.resize(n);
+        mNPCCell.resize(n);
+        for (size_t i=0; i < n; ++i)
+            mNPCCell[i] = calcCellIdx(npcs.mZ[i]);
+
+        rebuild();
+    }
+
+    // The scan of the cells is a plain loop over the positions, the moves
+    //  are for the few NPCs that crossed a boundary in the step (about one
+    //  per step with the default traffic)
+    void Update(const NPCArrays& npcs)
+    {
+        for (size_t i=0; i < npcs.size(); ++i)
+        {
+            const auto ci = calcCellIdx(npcs.mZ[i]);
+            if (ci != mNPCCell[i])
+                moveNPC((uint32_t)i, ci);
+        }
+    }
+
+    // fn(npcIdx) for the NPCs in the cells that cover [minZ, maxZ],
+    //  the caller checks the actual distance
+    template <typename F>
+    void ForEachInRange(float minZ, float maxZ, F&& fn) const
+    {
+        // z goes negative, so the cells go the other way
+        const auto c0 = calcCellIdx(maxZ);
+        const auto c1 = calcCellIdx(minZ);
+        for (auto k=mCellStarts[c0]; k < mCellStarts[c1+1]; ++k)
+            fn((size_t)mIdxs[k]);
+    }
+
+private:
+    static uint32_t calcCellIdx(float z)
+    {
+        const auto idx = (size_t)std::max(-z * (1.f / CELL_LEN), 0.f);
+        return (uint32_t)std::min(idx, CELLS_N - 1);
+    }
+
+    // from its cell to the cell ci, one boundary at a time. NPCs go to
+    //  the next cell, and back to the first when they wrap around the
+    //  track, which is the longer way but only happens once a lap
+    void moveNPC(uint32_t i, uint32_t ci)
+    {
+        auto c = mNPCCell[i];
+        auto k = findSlot(i, c);
+        while (c < ci)
+        {
+            // to the end of the span of c, which becomes the start of c+1
+            const auto last = mCellStarts[c + 1] - 1;
+            std::swap(mIdxs[k], mIdxs[last]);
+            k = last;
+            mCellStarts[c + 1] = last;
+            c += 1;
+        }
+        while (c > ci)
+        {
+            // to the start of the span of c, which becomes the end of c-1
+            const auto first = mCellStarts[c];
+            std::swap(mIdxs[k], mIdxs[first]);
+            k = first;
+            mCellStarts[c] = first + 1;
+            c -= 1;
+        }
+        mNPCCell[i] = ci;
+    }
+
+    // where the NPC i is in mIdxs, in the span of its cell c
+    uint32_t findSlot(uint32_t i, uint32_t c) const
+    {
+        auto k = mCellStarts[c];
+        while (mIdxs[k] != i)
+            ++k;
+        assert(k < mCellStarts[c + 1]);
+        return k;
+    }
+
+    // counting sort of the NPCs by cell
+    void rebuild()
+    {
+        std::fill(mCellStarts.begin(), mCellStarts.end(), 0);
+        for (const auto ci : mNPCCell)
+            mCellStarts[ci + 1] += 1;
+        for (size_t c=0; c < CELLS_N; ++c)
+            mCellStarts[c + 1] += mCellStarts[c];
+
+        // the starts move up as the cells fill...
+        for (size_t i=0; i < mNPCCell.size(); ++i)
+            mIdxs[mCellStarts[mNPCCell[i]]++] = (uint32_t)i;
+
+        // ...to the start of the next cell, put them back
+        for (size_t c=CELLS_N; c > 0; --c)
+            mCellStarts[c] = mCellStarts[c - 1];
+        mCellStarts[0] = 0;
+    }
+};
+
 //==================================================================
 template <typename VEC_T>
 static double calcYawToTarget(
@@ -226,48 +612,21 @@ static double calcYawToTarget(
 }
 
 //==================================================================
-static void fillVehicleSensors(Vehicle& vh, const std::vector<Vehicle>& others, size_t skipIdx)
+// Probe index of a target, the reference version, with the angles.
+//  Used near the edges of the probes, and to check calcProbeIdx() against,
+//  see ProbeCheck
+static size_t calcProbeIdxRef(const Float3& pos, const Float3& otherPos)
 {
-    // Fill in the basic sensors
-    vh.mSens[Vehicle::SENS_POS_X] = vh.mPos[0];
-    vh.mSens[Vehicle::SENS_SPEED] = vh.mSpeed;
-    vh.mSens[Vehicle::SENS_ACCEL] = vh.mAccel;
-    vh.mSens[Vehicle::SENS_VEL_X] = -vh.mSpeed * sinf(vh.mYawAng);
-    vh.mSens[Vehicle::SENS_VEL_Z] = -vh.mSpeed * cosf(vh.mYawAng);
-    vh.mSens[Vehicle::SENS_YAW] = vh.mYawAng;
-    vh.mSens[Vehicle::SENS_EDGE_DIST_NORM] = vh.mPos[0] / (SLAB_WIDTH * 0.5f);
-    for (size_t i=0; i < Vehicle::PROBES_N; ++i)
-    {
-        vh.mSens[Vehicle::SENS_PROBE_FIRST_X + i] = 0;
-        vh.mSens[Vehicle::SENS_PROBE_FIRST_UNITDIST + i] = 1.0f; // 1 at radius or more
-        vh.mSens[Vehicle::SENS_PROBE_FIRST_SPEED + i] = 0;
-        vh.mSens[Vehicle::SENS_PROBE_FIRST_YAW + i] = 0;
-    }
-
-    // Below, fill in the distance probes. Each probe is a sensor input for the net
-
     // arc of a probe
     const auto probeAngLen = PI2 / Vehicle::PROBES_N;
 
-    for (size_t i=0; i < others.size(); ++i)
-    {
-        if (i == skipIdx)
-            continue;
+    // find the yaw to the other vehicle
+    const auto yaw = calcYawToTarget(Float3(0,0,-1), pos, otherPos);
+    // select a sensor index based on the yaw, given PROBES_N distributed
+    // around the circle
 
-        const auto& other = others[i];
-
-        // get the distance, no sqr optimization 8)
-        const auto unitDist = glm::distance(vh.mPos, other.mPos) / VH_PROBE_RADIUS;
-        if (unitDist > 1.0f)
-            continue;
-
-        // find the yaw to the other vehicle
-        const auto yaw = calcYawToTarget(Float3(0,0,-1), vh.mPos, other.mPos);
-        // select a sensor index based on the yaw, given PROBES_N distributed
-        // around the circle
-
-        // offset the yaw so that we're in the middle of the range of the sensor
-        //  (we want the front sensor to grab left and right equally)
+    // offset the yaw so that we're in the middle of the range of the sensor
+    //  (we want the front sensor to grab left and right equally)
 #if 0
 example with 4 probes
                      0
@@ -282,108 +641,413 @@ example with 4 probes
 
 probeAngLen = 2*pi / 4 (90 degrees)
 #endif
-        // offset into our probe-space
-        auto probeYaw = yaw + probeAngLen * 0.5f;
-        // wrap around
-        if (probeYaw < 0)
-            probeYaw += PI2;
+    // offset into our probe-space
+    auto probeYaw = yaw + probeAngLen * 0.5f;
+    // wrap around
+    if (probeYaw < 0)
+        probeYaw += PI2;
+
+    // get the index, and wrap it around
+    return (size_t)((probeYaw / PI2) * (float)Vehicle::PROBES_N) % Vehicle::PROBES_N;
+}
+
+//==================================================================
+// Probe index of a target at (dx, dz) from us, same as calcProbeIdxRef()
+//  but with no angles: the octant comes from the signs and from which of
+//  |dx| and |dz| is larger, then the probe in the octant from the ratio
+//  of the two, compared with the tangents of the probes' edges.
+// Branch-free, to be vectorized in loops
+static_assert(Vehicle::PROBES_N == 32, "4 probes per octant");
+
+// tan() of the probes' edges in an octant, at 1, 3, 5 and 7 * pi/32
+static constexpr float PROBE_EDGE_TANS[4] = { 0.0984914034f, 0.3033466836f, 0.5345111360f, 0.8206787908f };
+
+inline uint32_t calcProbeIdx(float dx, float dz)
+{
+    const auto a = std::abs(dx);
+    const auto b = std::abs(dz);
+    const auto mn = std::min(a, b);
+    const auto mx = std::max(a, b);
+
+    // quadrant, counter-clockwise from +x, as atan2(dz, dx) goes
+    //  (dz >= 0 ? (dx > 0 ? 0 : 1) : (dx < 0 ? 2 : 3)), as arithmetic on
+    //  the compares, the compiler won't vectorize compares under a branch
+    const auto zNeg = (uint32_t)(dz < 0);
+    const auto xPos = (uint32_t)(dx > 0);
+    const auto xNeg = (uint32_t)(dx < 0);
+    const auto q = (1 - xPos) + zNeg * (2 + xPos - xNeg);
+    // octant, in the odd quadrants x and z swap roles
+    const uint32_t o = 2 * q + ((uint32_t)(b >= a) ^ (q & 1));
+
+    // edges passed from the axis, counted from the other side in the odd octants
+    uint32_t c = 0;
+    for (const auto t : PROBE_EDGE_TANS)
+        c += (uint32_t)(mn >= t * mx);
+    c += (o & 1) * (4 - 2 * c); // 4 - c when odd
+
+    // probe 0 is straight ahead (-z), a quarter turn after +x
+    return (4 * o + c + Vehicle::PROBES_N / 4) & (uint32_t)(Vehicle::PROBES_N - 1);
+}
 
-        // get the index, and wrap it around
-        const auto probeIdx = (size_t)((probeYaw / PI2) * (float)Vehicle::PROBES_N) % Vehicle::PROBES_N;
+// Right at an edge, calcProbeIdxRef() may fall on either side, depending
+//  on how its angles round, so calcProbeIdx() is only used outside of a
+//  thin band around the edges (about 1e-5 radians), and the few targets
+//  in the band go through calcProbeIdxRef(). Branch-free, as above
+static constexpr float PROBE_EDGE_BAND = 1e-5f;
+
+inline uint32_t isNearProbeEdge(float dx, float dz)
+{
+    const auto a = std::abs(dx);
+    const auto b = std::abs(dz);
+    const auto mn = std::min(a, b);
+    const auto mx = std::max(a, b);
+    const auto band = PROBE_EDGE_BAND * mx;
+
+    uint32_t near = 0;
+    for (const auto t : PROBE_EDGE_TANS)
+        near |= (uint32_t)(std::abs(mn - t * mx) <= band);
+    return near;
+}
+
+//==================================================================
+// Test mode: when enabled, fillVehicleSensors() also runs calcProbeIdxRef()
+//  on the targets in range and counts where the two disagree
+struct ProbeCheck
+{
+    static inline std::atomic<bool>   sEnabled {};
+    static inline std::atomic<size_t> sChecksN {};
+    static inline std::atomic<size_t> sMismatchesN {};
+};
+
+//==================================================================
+// The probes for a block of candidates. Squared distances and probe
+//  indices are a plain loop over the block (SIMD), then each probe keeps
+//  the nearest in range, in the order of the candidates
+static constexpr size_t PROBE_BLOCK_N = 16;
+// a little over the radius, the exact cut is on the unit distance
+static constexpr auto PROBE_RADIUS_SQR_MAX = VH_PROBE_RADIUS * VH_PROBE_RADIUS * 1.01f;
+
+static void fillProbesBlock(Vehicle& vh, const NPCArrays& npcs, const uint32_t* pIdxs, size_t n)
+{
+    assert(n <= PROBE_BLOCK_N);
+    float    dxs[PROBE_BLOCK_N];
+    float    dzs[PROBE_BLOCK_N];
+    float    distSqrs[PROBE_BLOCK_N];
+    uint32_t probeIdxs[PROBE_BLOCK_N];
+    uint32_t nearEdges[PROBE_BLOCK_N];
+
+    for (size_t j=0; j < n; ++j)
+    {
+        dxs[j] = npcs.mX[pIdxs[j]] - vh.mPos[0];
+        dzs[j] = npcs.mZ[pIdxs[j]] - vh.mPos[2];
+    }
+
+    for (size_t j=0; j < n; ++j)
+    {
+        distSqrs[j] = dxs[j] * dxs[j] + dzs[j] * dzs[j]; // the y is the same for all
+        probeIdxs[j] = calcProbeIdx(dxs[j], dzs[j]);
+        nearEdges[j] = isNearProbeEdge(dxs[j], dzs[j]);
+    }
+
+    const bool doCheck = ProbeCheck::sEnabled.load(std::memory_order_relaxed);
+    size_t mismatchesN = 0;
+    size_t checksN = 0;
+    for (size_t j=0; j < n; ++j)
+    {
+        if (distSqrs[j] > PROBE_RADIUS_SQR_MAX)
+            continue;
+
+        // as glm::distance() does it, to get the same values
+        const auto unitDist = std::sqrt(distSqrs[j]) / VH_PROBE_RADIUS;
+        if (unitDist > 1.0f)
+            continue;
+
+        const auto i = pIdxs[j];
+        const auto probeIdx = nearEdges[j]
+                                ? (uint32_t)calcProbeIdxRef(vh.mPos, npcs.GetPos(i))
+                                : probeIdxs[j];
+        if (doCheck)
+        {
+            checksN += 1;
+            mismatchesN += (calcProbeIdxRef(vh.mPos, npcs.GetPos(i)) != probeIdx);
+        }
 
         // now that we know into which probe does the target fall, see if the distance is
         // less than the current one, and overwrite if so
         if (unitDist < vh.mSens[Vehicle::SENS_PROBE_FIRST_UNITDIST + probeIdx])
         {
-            vh.mSens[Vehicle::SENS_PROBE_FIRST_X + probeIdx] = other.mPos[0];
+            vh.mSens[Vehicle::SENS_PROBE_FIRST_X + probeIdx] = npcs.mX[i];
             vh.mSens[Vehicle::SENS_PROBE_FIRST_UNITDIST + probeIdx] = unitDist;
-            vh.mSens[Vehicle::SENS_PROBE_FIRST_SPEED + probeIdx] = other.mSpeed;
-            vh.mSens[Vehicle::SENS_PROBE_FIRST_YAW + probeIdx] = other.mYawAng;
+            vh.mSens[Vehicle::SENS_PROBE_FIRST_SPEED + probeIdx] = npcs.mSpeed[i];
+            vh.mSens[Vehicle::SENS_PROBE_FIRST_YAW + probeIdx] = npcs.mYawAng;
         }
     }
+
+    if (doCheck)
+    {
+        ProbeCheck::sChecksN += checksN;
+        ProbeCheck::sMismatchesN += mismatchesN;
+    }
 }
 
 //==================================================================
-static size_t calcLaneIdx(float x)
+static void fillVehicleSensors(Vehicle& vh, const NPCArrays& npcs, const NPCGrid& grid)
 {
-    const auto laneWidth = SLAB_WIDTH / (float)ROAD_LANES_N;
-    const auto laneIdx = (size_t)((x + SLAB_WIDTH * 0.5f) / laneWidth);
-    return std::clamp(laneIdx, (size_t)0, (size_t)(ROAD_LANES_N-1));
+    // Fill in the basic sensors
+    vh.mSens[Vehicle::SENS_POS_X] = vh.mPos[0];
+    vh.mSens[Vehicle::SENS_SPEED] = vh.mSpeed;
+    vh.mSens[Vehicle::SENS_ACCEL] = vh.mAccel;
+    vh.mSens[Vehicle::SENS_VEL_X] = -vh.mSpeed * sinf(vh.mYawAng);
+    vh.mSens[Vehicle::SENS_VEL_Z] = -vh.mSpeed * cosf(vh.mYawAng);
+    vh.mSens[Vehicle::SENS_YAW] = vh.mYawAng;
+    vh.mSens[Vehicle::SENS_EDGE_DIST_NORM] = vh.mPos[0] / (SLAB_WIDTH * 0.5f);
+    for (size_t i=0; i < Vehicle::PROBES_N; ++i)
+    {
+        vh.mSens[Vehicle::SENS_PROBE_FIRST_X + i] = 0;
+        vh.mSens[Vehicle::SENS_PROBE_FIRST_UNITDIST + i] = 1.0f; // 1 at radius or more
+        vh.mSens[Vehicle::SENS_PROBE_FIRST_SPEED + i] = 0;
+        vh.mSens[Vehicle::SENS_PROBE_FIRST_YAW + i] = 0;
+    }
+
+    // Below, fill in the distance probes. Each probe is a sensor input for the net
+
+    // only the NPCs that may be within the probe radius, a block at a time
+    uint32_t idxs[PROBE_BLOCK_N];
+    size_t idxsN = 0;
+    const auto probeMinZ = vh.mPos[2] - VH_PROBE_RADIUS;
+    const auto probeMaxZ = vh.mPos[2] + VH_PROBE_RADIUS;
+    grid.ForEachInRange(probeMinZ, probeMaxZ, [&](size_t i)
+    {
+        idxs[idxsN++] = (uint32_t)i;
+        if (idxsN == PROBE_BLOCK_N)
+        {
+            fillProbesBlock(vh, npcs, idxs, idxsN);
+            idxsN = 0;
+        }
+    });
+    if (idxsN)
+        fillProbesBlock(vh, npcs, idxs, idxsN);
 }
 
 //==================================================================
-class Simulation
+// Why a simulation has ended
+enum class SimEndReason : uint8_t
 {
-    const SimpleNN* const mpNNet;
+    NONE,           // still running
+    ARRIVED,
+    HIT_VEHICLE,    // too many hits
+    HIT_CURB,
+    MAX_SIM_TIME,
+    MAX_STEPS,
+    STALLED,        // no progress along z
+    WATCHDOG,       // over the wall-clock time
+};
 
-    std::vector<Vehicle> mVehicles;
+inline const char* SimEndReasonToStr(SimEndReason r)
+{
+    switch (r)
+    {
+    case SimEndReason::NONE:         return "none";
+    case SimEndReason::ARRIVED:      return "arrived";
+    case SimEndReason::HIT_VEHICLE:  return "hit vehicle";
+    case SimEndReason::HIT_CURB:     return "hit curb";
+    case SimEndReason::MAX_SIM_TIME: return "max sim time";
+    case SimEndReason::MAX_STEPS:    return "max steps";
+    case SimEndReason::STALLED:      return "stalled";
+    case SimEndReason::WATCHDOG:     return "watchdog";
+    }
+    return "?";
+}
 
-    double               mRunTimeS = 0;
-    int                  mHitVehicleCnt = 0;
-    int                  mHitCurbCnt = 0;
-    bool                 mHasArrived = false;
+// When to give up on a run that doesn't arrive or crash, 0 to disable
+//  a limit. The watchdog is the only one that depends on the machine
+//  (and so breaks determinism), it's meant as a last resort for training
+struct SimLimits
+{
+    double  maxSimTimeS     = 120;
+    size_t  maxStepsN       = 0;
+    // stalled if in stallWindowS it didn't advance at least stallMinAdvM
+    double  stallWindowS    = 5;
+    float   stallMinAdvM    = VH_CRAWL_SPEED_MS;
+    double  maxWallTimeS    = 0;
+
+    // no limits, runs until it arrives or crashes (e.g. to play)
+    static SimLimits CreateUnlimited()
+    {
+        SimLimits lim;
+        lim.maxSimTimeS = 0;
+        lim.stallWindowS = 0;
+        return lim;
+    }
+};
 
-public:
-    Simulation(uint32_t seed, const SimpleNN* pNNet)
-        : mpNNet(pNNet)
+// The step the hit counts are measured in: a step of dt in contact counts
+//  as dt / SIM_REF_DT hits, so the score doesn't depend on the dt used
+static constexpr auto SIM_REF_DT = 1.f / 60.f;
+
+// How a step of AnimateSim(dt) is carried out, for when dt is large (e.g.
+//  for faster training), so that it plays like the small steps
+struct SimStepping
+{
+    // the controls of the step are applied over this many sub-steps of
+    //  dt/ctrlSubstepsN, integrating our vehicle as with a smaller dt
+    size_t  ctrlSubstepsN   = 1;
+    // hits are tested along the motion of the step (swept boxes) instead
+    //  of only at its end, so fast vehicles can't go through each other.
+    //  Off by default, as at SIM_REF_DT the step is small enough and the
+    //  end test is how the hits have always been counted
+    bool    useSweptHits    = false;
+};
+
+//==================================================================
+// The part of the way (0..1) that a point moving from (x0,z0) to (x1,z1)
+//  spends inside the box of half sizes (hx,hz) at the origin, with the
+//  same open bounds as the overlap test. For two moving boxes, the point
+//  is the relative position of their centers and the box is their sum
+inline float calcSweptBoxInLen(float x0, float z0, float x1, float z1, float hx, float hz)
+{
+    // the part of [0,1] where the point is inside, clipped by each axis
+    float s0 = 0;
+    float s1 = 1;
+    auto clip = [&](float p0, float p1, float h)
     {
-        // 0, is our vehicle
+        const auto d = p1 - p0;
+        if (d == 0)
+            return std::abs(p0) < h;
+
+        auto a = (-h - p0) / d;
+        auto b = ( h - p0) / d;
+        if (a > b)
+            std::swap(a, b);
+        s0 = std::max(s0, a);
+        s1 = std::min(s1, b);
+        return true;
+    };
+    if (!clip(x0, x1, hx) || !clip(z0, z1, hz))
+        return 0.f;
+    return std::max(s1 - s0, 0.f);
+}
+
+//==================================================================
+// A simulation can have several of our vehicles ("egos"), each driven by
+//  its own net, in the same traffic. They don't see or hit each other, so
+//  each does as it would alone, and one world scores several nets.
+class Simulation
+{
+    using Clock = std::chrono::steady_clock;
+
+    // wall-clock checked every few steps, reading it isn't free
+    static constexpr size_t WATCHDOG_CHECK_STEPS_N = 64;
+
+    // one of our vehicles, and how it's doing
+    struct Ego
+    {
+        const SimpleNN* mpNNet {};
+        Vehicle         mVh;
+
+        // where it was at the sub-steps of the last step, for the swept hits
+        std::vector<Float3> mPath;
+
+        double          mRunTimeS = 0;
+        size_t          mStepsN = 0;
+        // in steps of SIM_REF_DT
+        double          mHitVehicleCnt = 0;
+        double          mHitCurbCnt = 0;
+        bool            mHasArrived = false;
+        SimEndReason    mEndReason = SimEndReason::NONE;
+
+        // start of the current stall window
+        double          mStallRefTimeS = 0;
+        float           mStallRefZ = 0;
+
+        bool IsRunning() const { return mEndReason == SimEndReason::NONE; }
+
+        // back at the start, keeps the net and the buffers
+        void Reset(size_t pathN)
         {
-            Vehicle vh;
-            vh.mPos[0] = 0;
-            vh.mPos[1] = VH_ELEVATION;
-            vh.mPos[2] = SLAB_STA_IDX * -SLAB_DEPTH;
-            vh.mIsNPC = false;
-            mVehicles.push_back(vh);
+            mVh = Vehicle();
+            mVh.mPos[0] = 0;
+            mVh.mPos[1] = VH_ELEVATION;
+            mVh.mPos[2] = SLAB_STA_IDX * -SLAB_DEPTH;
+            mPath.assign(pathN, mVh.mPos);
+
+            mRunTimeS = 0;
+            mStepsN = 0;
+            mHitVehicleCnt = 0;
+            mHitCurbCnt = 0;
+            mHasArrived = false;
+            mEndReason = SimEndReason::NONE;
+            mStallRefTimeS = 0;
+            mStallRefZ = mVh.mPos[2];
         }
+    };
 
-        // random gen and distribution
-        std::mt19937 gen(seed);
-        std::uniform_real_distribution<float> dist(0.f, 1.f);
+    const SimLimits      mLimits;
+    const SimStepping    mStepping;
 
-        // generate some NPC vehicles
-        for (size_t i=0; i < NPC_SPAWN_N; ++i)
-        {
-            Vehicle vh;
-            vh.mIsNPC = true;
+    std::vector<Ego>     mEgos;
+    size_t               mRunningEgosN = 0;
 
-            // common height
-            vh.mPos[1] = VH_ELEVATION;
-            // random distance for the extent of the road
-            vh.mPos[2] = dist(gen) * -ROAD_LEN_M;
+    NPCArrays            mNPCs;
+    NPCGrid              mNPCGrid;
+    // scratch for the swept hits
+    std::vector<float>   mSegContacts;
 
-            if (dist(gen) < NPC_STRANDED_P)
-            {
-                // right att he edge of the road, left or right
-                vh.mPos[0] = (dist(gen) < 0.5f) ? -SLAB_WIDTH * 0.5f : SLAB_WIDTH * 0.5f;
-                vh.mSpeed = 0; // speed == 0 -> stranded
-            }
-            else
-            {
-                // random x at center of each lane, based on ROAD_LANES_N
-                const auto laneW = SLAB_WIDTH / ROAD_LANES_N;
-                const auto lane = floor( dist(gen) * (ROAD_LANES_N-1) + 0.5f );
-                const auto x = lane * laneW - SLAB_WIDTH * 0.5f + laneW * 0.5f;
+    // the time of the world, same as that of the egos still running
+    double               mTimeS = 0;
+    size_t               mStepsN = 0;
+    Clock::time_point    mWallStartT {};
 
-                vh.mPos[0] = x;
-                vh.mSpeed = glm::mix(NPC_SPEED_MIN_MS, NPC_SPEED_MAX_MS, dist(gen));
-            }
+public:
+    Simulation(
+            uint32_t seed,
+            const SimpleNN* pNNet,
+            const SimLimits& limits={},
+            const SimStepping& stepping={})
+        : Simulation(seed, &pNNet, 1, limits, stepping)
+    {}
+
+    // egosN of our vehicles, driven by ppNNets[0..egosN)
+    Simulation(
+            uint32_t seed,
+            const SimpleNN* const* ppNNets,
+            size_t egosN,
+            const SimLimits& limits={},
+            const SimStepping& stepping={})
+        : mLimits(limits)
+        , mStepping(makeValidStepping(stepping))
+    {
+        mEgos.resize(egosN);
+        for (size_t ei=0; ei < egosN; ++ei)
+            mEgos[ei].mpNNet = ppNNets[ei];
 
-            const auto& ourVh = mVehicles[0];
+        Reset(seed);
+    }
 
-            // reject if the starting position is too close to our vehicle
-            if (glm::distance(vh.mPos, ourVh.mPos) < NPC_MIN_SPAWN_R)
-                continue;
+    // Start over, on the scenario of seed, with the same nets. Once the
+    //  buffers have grown, nothing is allocated, so the same simulation
+    //  can be reused for each sample (see SimBatch::Reset())
+    void Reset(uint32_t seed)
+    {
+        if (mLimits.maxWallTimeS > 0)
+            mWallStartT = Clock::now();
 
-            // if they are very close and on the same lane
-            if (std::abs(vh.mPos[2] - ourVh.mPos[2]) < NPC_MIN_SPAWN_ZDIST &&
-                    calcLaneIdx(vh.mPos[0]) == calcLaneIdx(ourVh.mPos[0]))
-                continue;
+        mTimeS = 0;
+        mStepsN = 0;
 
-            mVehicles.push_back(vh);
-        }
+        // our vehicles, all at the same start
+        for (auto& ego : mEgos)
+            ego.Reset(mStepping.ctrlSubstepsN + 1);
+        mRunningEgosN = mEgos.size();
+
+        // the NPCs of the scenario (shared by the simulations of the same seed)
+        mNPCs.SetFromTraffic(*ScenarioTraffic::Get(seed));
+        mNPCGrid.Build(mNPCs);
     }
 
+    // change the net of one of our vehicles, e.g. before Reset()
+    void SetNNet(const SimpleNN* pNNet, size_t ei=0) { mEgos[ei].mpNNet = pNNet; }
+
     // This is the simulation step which takes inputs, feeds them to the
     //  neural network to generate outputs, which are then applied to the
     //  vehicle being simulated.
@@ -394,35 +1058,172 @@ public:
         if (!IsSimRunning())
             return;
 
-        mRunTimeS += dt;
-
-        // animate the vehicles
-        auto& ourVh = mVehicles[0];
-        fillVehicleSensors(ourVh, mVehicles, 0);
+        BeginStep();
 
-        // apply the net, if we have one 8)
-        if (mpNNet)
+        // apply the nets, if we have them 8)
+        for (auto& ego : mEgos)
         {
-            auto inputs = Tensor::CreateVecView(Vehicle::SENS_N, ourVh.mSens);
-            auto outputs = Tensor::CreateVecView(Vehicle::CTRL_N, ourVh.mCtrls);
+            if (!ego.IsRunning() || !ego.mpNNet)
+                continue;
+
+            auto inputs = Tensor::CreateVecView(Vehicle::SENS_N, ego.mVh.mSens);
+            auto outputs = Tensor::CreateVecView(Vehicle::CTRL_N, ego.mVh.mCtrls);
 
             // Apply the neural network to the inputs to generate the outputs
-            mpNNet->ForwardPass(outputs, inputs);
+            ego.mpNNet->ForwardPass(outputs, inputs);
+        }
+
+        EndStep(dt);
+    }
+
+    // AnimateSim() in two halves, for when the nets are run elsewhere (e.g.
+    //  batched with other simulations, see SimBatch.h):
+    //  BeginStep() fills GetSensors(), then the nets set GetControls(),
+    //  then EndStep() moves things forward
+    void BeginStep()
+    {
+        for (auto& ego : mEgos)
+            if (ego.IsRunning())
+                fillVehicleSensors(ego.mVh, mNPCs, mNPCGrid);
+    }
+
+    const float* GetSensors(size_t ei=0) const { return mEgos[ei].mVh.mSens; }
+    float* GetControls(size_t ei=0) { return mEgos[ei].mVh.mCtrls; }
+
+    void EndStep(float dt)
+    {
+        const auto subStepsN = mStepping.ctrlSubstepsN;
+        const auto subDt = dt / (float)subStepsN;
+
+        mTimeS += dt;
+        mStepsN += 1;
+
+        for (auto& ego : mEgos)
+        {
+            if (!ego.IsRunning())
+                continue;
+
+            ego.mRunTimeS += dt;
+            ego.mStepsN += 1;
+
+            auto& ourVh = ego.mVh;
 
             // clamp the outputs in the valid ranges
             for (auto& x : ourVh.mCtrls)
                 x = glm::clamp(x, 0.f, 1.f);
+
+            ego.mPath[0] = ourVh.mPos;
+            for (size_t k=0; k < subStepsN; ++k)
+            {
+                ourVh.ApplyControls(subDt);
+                ourVh.AnimateVehicle(subDt);
+                ego.mPath[k+1] = ourVh.mPos;
+            }
         }
 
-        for (auto& vh : mVehicles)
+        // the NPCs are where the scenario says they are at this time
+        mNPCs.UpdateZ((float)mTimeS);
+        mNPCGrid.Update(mNPCs);
+
+        for (auto& ego : mEgos)
         {
-            vh.ApplyControls(dt);
-            vh.AnimateVehicle(dt);
+            if (ego.IsRunning())
+            {
+                checkEgoEvents(ego, dt);
+                updateEndReason(ego);
+            }
+        }
+
+        // all the ones still running share the same wall-clock
+        if (mLimits.maxWallTimeS > 0 && (mStepsN % WATCHDOG_CHECK_STEPS_N) == 0)
+        {
+            const std::chrono::duration<double> elapsed = Clock::now() - mWallStartT;
+            if (elapsed.count() >= mLimits.maxWallTimeS)
+                for (auto& ego : mEgos)
+                    if (ego.IsRunning())
+                        ego.mEndReason = SimEndReason::WATCHDOG;
         }
 
+        mRunningEgosN = (size_t)std::count_if(mEgos.begin(), mEgos.end(),
+                                [](const Ego& e){ return e.IsRunning(); });
+    }
+
+    size_t GetEgosN() const { return mEgos.size(); }
+
+    double GetRunTimeS(size_t ei=0) const { return mEgos[ei].mRunTimeS; }
+    size_t GetStepsN(size_t ei=0) const { return mEgos[ei].mStepsN; }
+    SimEndReason GetEndReason(size_t ei=0) const { return mEgos[ei].mEndReason; }
+    bool HasHitVehicle(size_t ei=0) const { return mEgos[ei].mHitVehicleCnt > 0; }
+    bool HasHitCurb(size_t ei=0) const { return mEgos[ei].mHitCurbCnt > 0; }
+    bool HasArrived(size_t ei=0) const { return mEgos[ei].mHasArrived; }
+
+    // true while any of our vehicles is running
+    bool IsSimRunning() const { return mRunningEgosN != 0; }
+    bool IsEgoRunning(size_t ei) const { return mEgos[ei].IsRunning(); }
+
+    // Upper bound of GetSimScore(): arriving in the least time, at top
+    //  speed all the way (plus some room for the last step)
+    static constexpr double GetSimScoreMax()
+    {
+        constexpr auto distM = (double)(SLAB_END_IDX - SLAB_STA_IDX) * SLAB_DEPTH;
+        constexpr auto minTimeS = distM / VH_MAX_SPEED_MS;
+        return 1.01 * (1.0 + 1.0 / minTimeS);
+    }
+
+    // Get a score based on the current state of the simulation.
+    // This is used to evaluate the fitness of the neural network.
+    double GetSimScore(size_t ei=0) const
+    {
+        const auto& ego = mEgos[ei];
+        if (ego.mRunTimeS <= 0)
+            return 0;
+
+        const auto staZ = SLAB_STA_IDX * -SLAB_DEPTH;
+        const auto endZ = SLAB_END_IDX * -SLAB_DEPTH;
+
+        const auto curZ = ego.mVh.mPos[2];
+        const auto goalReachUnit = (curZ - staZ) / (endZ - staZ);
+
+        // distance is the most important factor
+        auto score = (double)goalReachUnit;
+
+        // strong penalty for crashing into something
+        if (ego.mHitVehicleCnt || ego.mHitCurbCnt)
+            score /= 1.0 + ego.mHitVehicleCnt + ego.mHitCurbCnt;
+
+        if (ego.mHasArrived)
+            score *= (1.0 + 1.0 / ego.mRunTimeS);
+
+        return score;
+    }
+
+    const Vehicle& GetOurVehicle(size_t ei=0) const { return mEgos[ei].mVh; }
+    const NPCArrays& GetNPCs() const { return mNPCs; }
+
+private:
+    static SimStepping makeValidStepping(SimStepping stepping)
+    {
+        stepping.ctrlSubstepsN = std::max(stepping.ctrlSubstepsN, (size_t)1);
+        return stepping;
+    }
+
+    // arrival, collisions and curbs, after the step
+    void checkEgoEvents(Ego& ego, float dt)
+    {
+        const auto& ourVh = ego.mVh;
+
         // see if we reached the end
         if (ourVh.mPos[2] < (-SLAB_DEPTH * SLAB_END_IDX))
-            mHasArrived = true;
+            ego.mHasArrived = true;
+
+        if (mStepping.useSweptHits)
+        {
+            checkEgoSweptHits(ego, dt);
+            return;
+        }
+
+        // a step in contact counts by how long it is
+        const auto hitW = (double)dt / (double)SIM_REF_DT;
 
         // slightly larger collision bounds
         const auto useW = VH_WIDTH * 1.05f;
@@ -433,73 +1234,160 @@ public:
         const auto ourMaxX = ourVh.mPos[0] + useW * 0.5f;
         const auto ourMinZ = ourVh.mPos[2] - useL * 0.5f;
         const auto ourMaxZ = ourVh.mPos[2] + useL * 0.5f;
-        for (size_t i=1; i < mVehicles.size(); ++i)
+        bool hasHit = false;
+        mNPCGrid.ForEachInRange(ourMinZ - useL, ourMaxZ + useL, [&](size_t i)
         {
-            const auto& vh = mVehicles[i];
-            const auto minX = vh.mPos[0] - useW * 0.5f;
-            const auto maxX = vh.mPos[0] + useW * 0.5f;
-            const auto minZ = vh.mPos[2] - useL * 0.5f;
-            const auto maxZ = vh.mPos[2] + useL * 0.5f;
+            const auto minX = mNPCs.mX[i] - useW * 0.5f;
+            const auto maxX = mNPCs.mX[i] + useW * 0.5f;
+            const auto minZ = mNPCs.mZ[i] - useL * 0.5f;
+            const auto maxZ = mNPCs.mZ[i] + useL * 0.5f;
 
             if (ourMinX < maxX && ourMaxX > minX &&
                 ourMinZ < maxZ && ourMaxZ > minZ)
-            {
-                mHitVehicleCnt += 1;
-                break;
-            }
-        }
+                hasHit = true;
+        });
+        if (hasHit)
+            ego.mHitVehicleCnt += hitW;
 
         // hard edges
         const auto edgeL = -SLAB_WIDTH * 0.5f;
         const auto edgeR =  SLAB_WIDTH * 0.5f;
         if (ourVh.mPos[0] < edgeL || ourVh.mPos[0] > edgeR)
             //mHitCurbCnt = true;
-            mHitCurbCnt += 1;
+            ego.mHitCurbCnt += hitW;
     }
 
-    double GetRunTimeS() const { return mRunTimeS; }
-    bool HasHitVehicle() const { return !!mHitVehicleCnt; }
-    bool HasHitCurb() const { return !!mHitCurbCnt; }
-    bool HasArrived() const { return mHasArrived; }
-
-    bool IsSimRunning() const
+    // Same as above, but along the path of the step: each sub-step of our
+    //  vehicle is swept against the NPCs (that move straight) and against
+    //  the road edges. A step with contact counts as many SIM_REF_DT steps
+    //  as the contact lasted (at least one), as with steps of SIM_REF_DT
+    void checkEgoSweptHits(Ego& ego, float dt)
     {
-        // Above this counter, should give up, because it may never end otherwise
-        constexpr int HIT_TOLERANCE = 50;
+        const auto& path = ego.mPath;
+        const auto segsN = path.size() - 1;
+        const auto segDt = (double)dt / (double)segsN;
 
-        return
-            mHitVehicleCnt < HIT_TOLERANCE &&
-            mHitCurbCnt < HIT_TOLERANCE &&
-            !mHasArrived;
+        auto toHitCnt = [](double contactS)
+        {
+            return std::max(1.0, std::ceil(contactS / (double)SIM_REF_DT - 1e-3));
+        };
+
+        // slightly larger collision bounds (the sum of two halves)
+        const auto useW = VH_WIDTH * 1.05f;
+        const auto useL = VH_LENGTH * 1.05f;
+
+        // look as far as we and the NPCs went in the step
+        auto minZ = path[0][2];
+        auto maxZ = path[0][2];
+        for (const auto& p : path)
+        {
+            minZ = std::min(minZ, p[2]);
+            maxZ = std::max(maxZ, p[2]);
+        }
+        const auto margin = useL * 1.5f + NPC_SPEED_MAX_MS * dt;
+
+        // contact per sub-step, with any of the NPCs
+        mSegContacts.assign(segsN, 0.f);
+        mNPCGrid.ForEachInRange(minZ - margin, maxZ + margin, [&](size_t i)
+        {
+            addNPCContacts(path, i, dt, useW, useL, mSegContacts.data());
+        });
+
+        double contactS = 0;
+        for (const auto c : mSegContacts)
+            contactS += (double)c * segDt;
+        if (contactS > 0)
+            ego.mHitVehicleCnt += toHitCnt(contactS);
+
+        // hard edges, the part of each sub-step off the road
+        const auto halfW = SLAB_WIDTH * 0.5f;
+        double outS = 0;
+        for (size_t k=0; k < segsN; ++k)
+        {
+            const auto inLen = calcSweptBoxInLen(
+                                    path[k][0], 0, path[k+1][0], 0, halfW, 1.f);
+            outS += (double)(1.f - inLen) * segDt;
+        }
+        if (outS > 0)
+            ego.mHitCurbCnt += toHitCnt(outS);
     }
 
-    // Get a score based on the current state of the simulation.
-    // This is used to evaluate the fitness of the neural network.
-    double GetSimScore() const
+    // the part of each sub-step of path (in the last step) in contact with
+    //  the NPC i, max'ed into pSegContacts
+    void addNPCContacts(
+            const std::vector<Float3>& path,
+            size_t i,
+            float dt,
+            float hx,
+            float hz,
+            float* pSegContacts) const
     {
-        if (mRunTimeS <= 0)
-            return 0;
+        const auto segsN = path.size() - 1;
+        const auto staT  = mTimeS - dt;
+        const auto segDt = (double)dt / (double)segsN;
 
-        const auto staZ = SLAB_STA_IDX * -SLAB_DEPTH;
-        const auto endZ = SLAB_END_IDX * -SLAB_DEPTH;
+        const auto npcX    = mNPCs.mX[i];
+        const auto npcStaZ = mNPCs.mStartZ[i];
+        const auto npcSpd  = mNPCs.mSpeed[i];
 
-        const auto curZ = mVehicles[0].mPos[2];
-        const auto goalReachUnit = (curZ - staZ) / (endZ - staZ);
+        // across a wrap of the track there's no motion to sweep
+        auto unwrap = [](float z0, float z1)
+        {
+            return std::abs(z1 - z0) > TRACK_LEN_M * 0.5f ? z1 : z0;
+        };
 
-        // distance is the most important factor
-        auto score = (double)goalReachUnit;
+        auto npcZ0 = calcNPCZ(npcStaZ, npcSpd, (float)staT);
+        for (size_t k=0; k < segsN; ++k)
+        {
+            const auto npcZ1 = (k+1 == segsN)
+                ? mNPCs.mZ[i]
+                : calcNPCZ(npcStaZ, npcSpd, (float)(staT + segDt * (double)(k+1)));
+
+            // relative to the NPC
+            const auto& p0 = path[k];
+            const auto& p1 = path[k+1];
+            const auto inLen = calcSweptBoxInLen(
+                    p0[0] - npcX, unwrap(p0[2], p1[2]) - unwrap(npcZ0, npcZ1),
+                    p1[0] - npcX, p1[2] - npcZ1,
+                    hx, hz);
+
+            pSegContacts[k] = std::max(pSegContacts[k], inLen);
+            npcZ0 = npcZ1;
+        }
+    }
 
-        // strong penalty for crashing into something
-        if (mHitVehicleCnt || mHitCurbCnt)
-            score /= 1.0 + mHitVehicleCnt + mHitCurbCnt;
+    void updateEndReason(Ego& ego)
+    {
+        // Above this counter, should give up, because it may never end otherwise
+        constexpr double HIT_TOLERANCE = 50;
 
-        if (mHasArrived)
-            score *= (1.0 + 1.0 / mRunTimeS);
+        const auto& lim = mLimits;
+        if (ego.mHasArrived)
+            ego.mEndReason = SimEndReason::ARRIVED;
+        else
+        if (ego.mHitVehicleCnt >= HIT_TOLERANCE)
+            ego.mEndReason = SimEndReason::HIT_VEHICLE;
+        else
+        if (ego.mHitCurbCnt >= HIT_TOLERANCE)
+            ego.mEndReason = SimEndReason::HIT_CURB;
+        else
+        if (lim.maxSimTimeS > 0 && ego.mRunTimeS >= lim.maxSimTimeS)
+            ego.mEndReason = SimEndReason::MAX_SIM_TIME;
+        else
+        if (lim.maxStepsN && ego.mStepsN >= lim.maxStepsN)
+            ego.mEndReason = SimEndReason::MAX_STEPS;
+        else
+        if (lim.stallWindowS > 0 && (ego.mRunTimeS - ego.mStallRefTimeS) >= lim.stallWindowS)
+        {
+            // we go towards -z
+            const auto curZ = ego.mVh.mPos[2];
+            if ((ego.mStallRefZ - curZ) < lim.stallMinAdvM)
+                ego.mEndReason = SimEndReason::STALLED;
 
-        return score;
+            ego.mStallRefTimeS = ego.mRunTimeS;
+            ego.mStallRefZ = curZ;
+        }
     }
-
-    const auto& GetVehicles() const { return mVehicles; }
 };
 
 #endif
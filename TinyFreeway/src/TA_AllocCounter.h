@@ -0,0 +1,100 @@
+//==================================================================
+/// TA_AllocCounter.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_ALLOCCOUNTER_H
+#define TA_ALLOCCOUNTER_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+//==================================================================
+// Test hook: counts the heap allocations made by the threads that are
+//  being tracked (see Scope), to check that a loop doesn't allocate
+//  (e.g. the training epochs after the first, see TrainingManager).
+// The counting is done by the global operator new, which the program
+//  replaces with TA_ALLOC_COUNTER_DEFINE_NEW in one of its sources.
+//  Without it, or when not enabled, the count stays at 0.
+class AllocCounter
+{
+    static inline std::atomic<size_t>   sAllocsN {};
+    static inline thread_local int      stTrackDepth {};
+
+public:
+    static inline std::atomic<bool>     sEnabled {};
+
+    // tracks the current thread while in scope
+    class Scope
+    {
+    public:
+        Scope() { ++stTrackDepth; }
+        ~Scope() { --stTrackDepth; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    static size_t GetAllocsN() { return sAllocsN.load(std::memory_order_relaxed); }
+
+    static void OnAlloc()
+    {
+        if (stTrackDepth && sEnabled.load(std::memory_order_relaxed))
+            sAllocsN.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void* Alloc(size_t size)
+    {
+        OnAlloc();
+        if (auto* p = std::malloc(size ? size : 1))
+            return p;
+        throw std::bad_alloc();
+    }
+
+    static void* AllocAligned(size_t size, std::align_val_t al)
+    {
+        OnAlloc();
+        const auto a = std::max((size_t)al, sizeof(void*));
+        const auto n = (size + a - 1) / a * a; // aligned_alloc wants a multiple
+#if defined(_WIN32)
+        if (auto* p = _aligned_malloc(n ? n : a, a))
+#else
+        if (auto* p = std::aligned_alloc(a, n ? n : a))
+#endif
+            return p;
+        throw std::bad_alloc();
+    }
+
+    static void Free(void* p) { std::free(p); }
+
+    static void FreeAligned(void* p)
+    {
+#if defined(_WIN32)
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+};
+
+// The replacement operator new/delete that count for AllocCounter.
+//  The other forms (arrays, nothrow) end up in these
+#define TA_ALLOC_COUNTER_DEFINE_NEW() \
+    void* operator new(size_t size) { return AllocCounter::Alloc(size); } \
+    void* operator new[](size_t size) { return AllocCounter::Alloc(size); } \
+    void* operator new(size_t size, std::align_val_t al) { return AllocCounter::AllocAligned(size, al); } \
+    void* operator new[](size_t size, std::align_val_t al) { return AllocCounter::AllocAligned(size, al); } \
+    void operator delete(void* p) noexcept { AllocCounter::Free(p); } \
+    void operator delete[](void* p) noexcept { AllocCounter::Free(p); } \
+    void operator delete(void* p, size_t) noexcept { AllocCounter::Free(p); } \
+    void operator delete[](void* p, size_t) noexcept { AllocCounter::Free(p); } \
+    void operator delete(void* p, std::align_val_t) noexcept { AllocCounter::FreeAligned(p); } \
+    void operator delete[](void* p, std::align_val_t) noexcept { AllocCounter::FreeAligned(p); } \
+    void operator delete(void* p, size_t, std::align_val_t) noexcept { AllocCounter::FreeAligned(p); } \
+    void operator delete[](void* p, size_t, std::align_val_t) noexcept { AllocCounter::FreeAligned(p); }
+
+#endif
@@ -14,82 +14,225 @@
 #include <vector>
 #include <memory>
 #include <mutex>
-#include <random>
+#include <algorithm>
+#include <cstring>
+#include "TA_Philox.h"
 #include "TA_SimpleNN.h"
+#include "TA_PopulationMatrix.h"
+#include "TA_ThreadPool.h"
+#include "TA_AllocCounter.h"
 
 //==================================================================
-static auto uniformCrossOver = [](auto& rng, const auto& a, const auto& b)
+// The random numbers of the operators come from counter-based streams
+//  (see TA_Philox.h) read by position, so the result for a child
+//  doesn't depend on the order or the thread in which it's made.
+// Genes are processed in chunks, the random words of a chunk are
+//  generated in bulk.
+static constexpr size_t EVO_RAND_CHUNK_N = 256;
+
+// Crossovers: write the child in res (e.g. a row of the new population)
+
+// a random parent per gene: 32 genes per random word, the bits select
+//  the parents with SIMD blends (see TensorKernels::BlendBits)
+static auto uniformCrossOver = [](const RandStream& rs, auto& res, const auto& a, const auto& b)
 {
-    auto res = a.CreateEmptyClone();
     auto* pRes = res.data();
     const auto* pA = a.data();
     const auto* pB = b.data();
-    const auto n = a.size();
+    const auto n = res.size();
 
-    std::uniform_real_distribution<double> uni(0.0, 1.0);
-    for (size_t i=0; i < n; ++i)
-        pRes[i] = uni(rng) < 0.5 ? pA[i] : pB[i];
-
-    return res;
+    const auto& kern = TensorKernels::Get();
+    constexpr size_t CHUNK_GENES_N = EVO_RAND_CHUNK_N * 32;
+    uint32_t bits[EVO_RAND_CHUNK_N];
+    for (size_t i=0; i < n; i += CHUNK_GENES_N)
+    {
+        const auto cN = std::min(CHUNK_GENES_N, n - i);
+        rs.FillBits(bits, i / 32, (cN + 31) / 32);
+        kern.BlendBits(pRes + i, pA + i, pB + i, bits, cN);
+    }
 };
 
-static auto calcMeanAndStddev = [](const auto& vec)
+// a random parent per block, the blocks are given by their first gene
+//  (e.g. the rows of the weights and the biases of each layer)
+static auto blockCrossOver = [](
+        const RandStream& rs,
+        auto& res,
+        const auto& a,
+        const auto& b,
+        const std::vector<size_t>& blockStarts)
 {
-    float sum = 0.0f;
-    float sum_squared = 0.0f;
-    const auto* p = vec.data();
-    const auto n = vec.size();
+    auto* pRes = res.data();
+    const auto* pA = a.data();
+    const auto* pB = b.data();
+    const auto n = res.size();
+
+    const auto blocksN = blockStarts.size();
+    for (size_t bi=0; bi < blocksN; ++bi)
+    {
+        const auto s = blockStarts[bi];
+        const auto e = (bi + 1 < blocksN) ? blockStarts[bi + 1] : n;
+        const auto* pSrc = (rs.BitsAt(bi) >> 31) ? pB : pA;
+        std::memcpy(pRes + s, pSrc + s, (e - s) * sizeof(*pRes));
+    }
+};
 
-    for (size_t i=0; i < n; ++i)
+// the parents alternate at k random cut points, from a random one
+static constexpr size_t EVO_MAX_CUTS_N = 16;
+static auto kPointCrossOver = [](
+        const RandStream& rs,
+        auto& res,
+        const auto& a,
+        const auto& b,
+        size_t cutsN)
+{
+    auto* pRes = res.data();
+    const auto* pA = a.data();
+    const auto* pB = b.data();
+    const auto n = res.size();
+
+    assert(cutsN <= EVO_MAX_CUTS_N);
+    size_t cuts[EVO_MAX_CUTS_N + 1];
+    for (size_t i=0; i < cutsN; ++i)
+        cuts[i] = (size_t)(((uint64_t)rs.BitsAt(i) * n) >> 32);
+    std::sort(cuts, cuts + cutsN);
+    cuts[cutsN] = n;
+
+    auto useB = (rs.BitsAt(cutsN) >> 31) != 0;
+    size_t s = 0;
+    for (size_t i=0; i <= cutsN; ++i)
     {
-        const auto x = p[i];
-        sum += x;
-        sum_squared += x * x;
+        const auto* pSrc = useB ? pB : pA;
+        std::memcpy(pRes + s, pSrc + s, (cuts[i] - s) * sizeof(*pRes));
+        s = cuts[i];
+        useB = !useB;
     }
+};
+
+static auto calcMeanAndStddevFromSums = [](double sum, double sumSq, size_t n)
+{
     const auto mean = sum / n;
-    const auto dcar = (sum_squared / n) - (mean * mean);
-    const auto std_dev = sqrt(dcar);
+    const auto dcar = (sumSq / n) - (mean * mean);
+    const auto std_dev = std::sqrt(std::max(dcar, 0.0));
+
+    return std::make_pair((float)mean, (float)std_dev);
+};
+
+static auto calcMeanAndStddev = [](const auto& vec)
+{
+    return calcMeanAndStddevFromSums(vec.Sum(), vec.SumSq(), vec.size());
+};
 
-    return std::make_pair(mean, std_dev);
+// sum of the absolute values, for mutateScaled
+static auto calcAbsSum = [](const auto& vec)
+{
+    double absSum = 0;
+    const auto* p = vec.data();
+    for (size_t i=0; i < vec.size(); ++i)
+        absSum += std::abs(p[i]);
+    return absSum;
 };
 
-static auto mutateNormalDist = [](auto& rng, const auto& vec, float rate)
+//==================================================================
+// The genes to mutate, each with probability rate, without a trial per
+//  gene: the gaps between them are geometric, drawn from the stream.
+//  The k-th mutated gene uses word k of the stream, so the cost goes
+//  with the number of mutated genes, not with the size of the genome.
+class MutationSkipper
 {
-    auto newVec = vec;
-    const auto [mean, stddev] = calcMeanAndStddev(vec);
-    auto* p = newVec.data();
-    const auto n = newVec.size();
+    const RandStream&   mRS;
+    const size_t        mN;
+    const float         mInvLogQ;
+    size_t              mNextIdx {};
+    size_t              mUsedN {};
+
+public:
+    MutationSkipper(const RandStream& rs, size_t n, float rate)
+        : mRS(rs)
+        , mN(rate > 0 ? n : 0)
+        , mInvLogQ(1.f / std::log1p(-std::min(rate, 1.f)))
+    {}
 
-    std::normal_distribution<float> nor(mean, stddev);
-    std::uniform_real_distribution<float> uni(0.0, 1.0);
-    for (size_t i=0; i < n; ++i)
+    // the mutations done so far, e.g. to index another stream
+    size_t GetUsedN() const { return mUsedN; }
+
+    // the indices of the next (up to maxN) genes to mutate, 0 at the end
+    size_t Next(size_t* pIdxs, size_t maxN)
     {
-        if (uni(rng) < rate)
-            p[i] += (SCALAR)nor(rng);
+        maxN = std::min(maxN, EVO_RAND_CHUNK_N);
+        uint32_t bits[EVO_RAND_CHUNK_N];
+        mRS.FillBits(bits, mUsedN, maxN);
+
+        size_t cN = 0;
+        for (; cN < maxN && mNextIdx < mN; ++cN)
+        {
+            // failures before a success, P(gap >= g) = (1 - rate)^g
+            const auto gap = std::log(philox::toUnitNZ(bits[cN])) * mInvLogQ;
+            if (gap >= (float)(mN - mNextIdx))
+            {
+                mNextIdx = mN;
+                break;
+            }
+            mNextIdx += (size_t)gap;
+            pIdxs[cN] = mNextIdx++;
+        }
+        mUsedN += cN;
+        return cN;
     }
-    return newVec;
 };
 
-static auto mutateScaled = [](auto& rng, const auto& vec, float rate)
+// mutates in place, adding normals with the given mean and stddev (e.g.
+//  of the genes, see calcMeanAndStddev)
+static auto mutateNormalDist = [](
+        const RandStream& rs,
+        auto& vec,
+        float rate,
+        const std::pair<float, float>& meanStddev)
 {
-    auto newVec = vec;
-    double absSum = 0;
-
-    auto* p = newVec.data();
-    const auto n = newVec.size();
-    for (size_t i=0; i < n; ++i)
-        absSum += std::abs(p[i]);
+    const auto [mean, stddev] = meanStddev;
+    auto* p = vec.data();
+
+    // the normals from another stream, a chunk at a time
+    const auto rsNor = rs.Fork(1);
+    MutationSkipper skipper(rs, vec.size(), rate);
+    size_t idxs[EVO_RAND_CHUNK_N];
+    float nors[EVO_RAND_CHUNK_N];
+    for (;;)
+    {
+        const auto k0 = skipper.GetUsedN();
+        const auto cN = skipper.Next(idxs, EVO_RAND_CHUNK_N);
+        if (!cN)
+            break;
+
+        rsNor.FillNormal(nors, k0, cN);
+        for (size_t j=0; j < cN; ++j)
+            p[idxs[j]] += (SCALAR)(mean + stddev * nors[j]);
+    }
+};
 
-    const auto avg = (SCALAR)(absSum / (double)n);
-    const auto useSca = std::max( (SCALAR)1.0, avg );
+// mutates in place, adding uniforms in +/- the mean of the absolute
+//  values of the genes (at least 1), given by the caller (e.g. from the
+//  sums of the parents, see mRowSums), so the cost is in the mutations
+static auto mutateScaled = [](const RandStream& rs, auto& vec, float rate, double absMean)
+{
+    auto* p = vec.data();
+    const auto n = vec.size();
+    const auto useSca = std::max( (SCALAR)1.0, (SCALAR)absMean );
 
-    std::uniform_real_distribution<float> uni(0.0, 1.0);
-    for (size_t i=0; i < n; ++i)
+    const auto rsAmt = rs.Fork(1);
+    MutationSkipper skipper(rs, n, rate);
+    size_t idxs[EVO_RAND_CHUNK_N];
+    float unis[EVO_RAND_CHUNK_N];
+    for (;;)
     {
-        if (uni(rng) < rate)
-            p[i] += (SCALAR)((uni(rng) * 2 - 1) * useSca);
+        const auto k0 = skipper.GetUsedN();
+        const auto cN = skipper.Next(idxs, EVO_RAND_CHUNK_N);
+        if (!cN)
+            break;
+
+        rsAmt.FillUniform(unis, k0, cN);
+        for (size_t j=0; j < cN; ++j)
+            p[idxs[j]] += (SCALAR)((unis[j] * 2 - 1) * useSca);
     }
-    return newVec;
 };
 
 //==================================================================
@@ -118,89 +261,227 @@ class EvolutionEngine
     static constexpr size_t TOP_FOR_SELECTION_N = 10;
     static constexpr size_t TOP_FOR_REPORT_N    = 10;
 
+    // cut points of the k-point crossover
+    static constexpr size_t   KPOINT_CUTS_N = 2;
+
     std::vector<size_t>     mLayerNs;
+    std::vector<ActivType>  mLayerActs;
+
+    // current and next generation, swapped at each new evolution
+    PopulationMatrix        mPops[2];
+    size_t                  mCurPopIdx {};
+    // (row index, info) sorted by fitness, kept to not reallocate
+    vector<std::pair<size_t, const ParamsInfo*>> mSorted;
 
     // best params list just for display
     std::mutex              mBestPoolMutex;
-	std::vector<Tensor>     mBestPool;
+    PopulationMatrix        mBestPool;
     std::vector<ParamsInfo> mBestPInfos;
 
 public:
-    EvolutionEngine(const std::vector<size_t>& layerNs) : mLayerNs(layerNs) {}
+    // the crossover operators
+    enum class CrossOp
+    {
+        UNIFORM,    // a parent per gene
+        BLOCK,      // a parent per block: a row of weights, or the biases
+        KPOINT,     // a parent per span, between KPOINT_CUTS_N cuts
+    };
+
+private:
+    const CrossOp           mCrossOp;
+    // first gene of each block, for CrossOp::BLOCK
+    std::vector<size_t>     mBlockStarts;
+
+    // how to make a child of the new generation
+    struct ChildPlan
+    {
+        size_t  parentA {}; // rows in the current generation
+        size_t  parentB {};
+        CrossOp crossOp {};
+        bool    mutate {};
+    };
+    vector<ChildPlan>       mPlan;
+    // sums of the genes of the parents (by row), to get the stats of a
+    //  child without a pass on it
+    struct RowSums
+    {
+        double  sum {};
+        double  sumSq {};
+        double  absSum {};
+    };
+    vector<RowSums>         mRowSums;
+
+public:
+    EvolutionEngine(
+            const std::vector<size_t>& layerNs,
+            const std::vector<ActivType>& layerActs={},
+            CrossOp crossOp=CrossOp::UNIFORM)
+        : mLayerNs(layerNs)
+        , mLayerActs(layerActs)
+        , mCrossOp(crossOp)
+    {
+        // the blocks follow the layout of the flat params: per layer, the
+        //  weights (a row per input) then the biases
+        size_t pos = 0;
+        for (size_t i=0; i+1 < layerNs.size(); ++i)
+        {
+            for (size_t r=0; r < layerNs[i]; ++r)
+                mBlockStarts.push_back(pos + r * layerNs[i+1]);
+            pos += layerNs[i] * layerNs[i+1];
+            mBlockStarts.push_back(pos);
+            pos += layerNs[i+1];
+        }
+        assert(pos == SimpleNN::CalcNNSize(layerNs));
+    }
+
+    // how many of the best matter (for selection and report), the order
+    //  of the others makes no difference
+    static constexpr size_t GetRankedN()
+    {
+        return std::max(TOP_FOR_SELECTION_N, TOP_FOR_REPORT_N);
+    }
+
+    // the largest population of any generation, to size the buffers once
+    static constexpr size_t GetMaxPopulationN()
+    {
+        size_t newN = 0;
+        forEachCouple([&](size_t, size_t){ newN += 2; });
+        return std::max(INIT_POP_N, newN);
+    }
 
     //==================================================================
     unique_ptr<SimpleNN> CreateNetwork(const Tensor &params)
     {
-        return std::make_unique<SimpleNN>(params, mLayerNs);
+        return std::make_unique<SimpleNN>(params, mLayerNs, mLayerActs);
+    }
+
+    // network that works directly on the params, no allocation, no copy.
+    //  Not packed, see SimpleNN::CreateView()
+    SimpleNN CreateNetworkView(const Tensor &params) const
+    {
+        return SimpleNN::CreateView(params, mLayerNs, mLayerActs);
     }
 
     //==================================================================
-    // initial list of parameters
-    vector<Tensor> CreateInitialPopulation()
+    // initial list of parameters, in parallel with pThPool
+    const PopulationMatrix& CreateInitialPopulation(ThreadPool* pThPool=nullptr)
     {
-        std::vector<Tensor> pool;
-        pool.reserve(INIT_POP_N);
-        for (size_t i=0; i < INIT_POP_N; ++i)
+        // room for the largest generation, so the next ones don't allocate
+        const auto colsN = SimpleNN::CalcNNSize(mLayerNs);
+        for (auto& p : mPops)
+            p.Resize(GetMaxPopulationN(), colsN);
+        mSorted.reserve(GetMaxPopulationN());
+        mPlan.reserve(GetMaxPopulationN());
+        mRowSums.reserve(GetMaxPopulationN());
+
+        auto& pop = mPops[mCurPopIdx];
+        pop.Resize(INIT_POP_N, colsN);
+        auto makeIndividual = [&](size_t i)
         {
             // Generate a random network and store it as a flat tensor
-            SimpleNN net((uint32_t)i, mLayerNs);
-            pool.push_back(net.FlattenNN());
-        }
-        return pool;
+            SimpleNN net((uint32_t)i + 1, mLayerNs, mLayerActs); // 0 is a random seed
+            pop.SetRow(i, net.FlattenNN().data());
+        };
+        if (pThPool)
+            pThPool->ParallelFor(0, INIT_POP_N, 1, makeIndividual);
+        else
+            for (size_t i=0; i < INIT_POP_N; ++i)
+                makeIndividual(i);
+
+        return pop;
     }
     //==================================================================
     // when an epoch has ended
-    vector<Tensor> CreateNewEvolution(
+    // The new population goes in the other buffer, so pool (the current
+    //  one) stays valid until the next call
+    // With pThPool, the children are made in parallel, with the same
+    //  results as without
+    const PopulationMatrix& CreateNewEvolution(
             size_t epochIdx,
-            const Tensor* pPool,
+            const PopulationMatrix& pool,
             const ParamsInfo* pInfos,
-            size_t n)
+            ThreadPool* pThPool=nullptr)
     {
+        const auto n = pool.size_rows();
+
         // sort by the cost
-        std::vector<std::pair<const Tensor*, const ParamsInfo*>> pSorted;
+        mSorted.clear();
         for (size_t i=0; i < n; ++i)
-            pSorted.push_back({ pPool + i, pInfos + i });
+            mSorted.push_back({ i, pInfos + i });
 
-        std::sort(pSorted.begin(), pSorted.end(), [](const auto& a, const auto& b)
+        std::sort(mSorted.begin(), mSorted.end(), [](const auto& a, const auto& b)
         {
             return a.second->ci_fitness > b.second->ci_fitness;
         });
 
         // update the list of best params (with a lock... we're in a different thread)
-        updateBestPool(pSorted);
+        updateBestPool(pool);
+
+        // plan the children first: the parents and the operators of each
+        mPlan.clear();
 
-        // random generator
-        const auto seed = (unsigned int)epochIdx;
-        std::mt19937 rng(seed);
-        std::uniform_real_distribution<double> dist(0.0, 1.0);
+        // elitism: keep top 1% (a crossover with itself is a copy)
+        //for (size_t i=0; i < std::max<size_t>(1, n/100); ++i)
+        //    mPlan.push_back({ mSorted[i].first, mSorted[i].first, CrossOp::UNIFORM, false });
 
-        // mutation function
-        auto mutateChromo = [&](const Tensor &params)
+        // each couple: one plain child and one with some mutations
+        forEachCouple([&](size_t i, size_t j)
         {
-            //return mutateScaled(rng, params, (SCALAR)0.2);
-            return mutateNormalDist(rng, params, (SCALAR)0.1);
-        };
+            mPlan.push_back({ mSorted[i].first, mSorted[j].first, mCrossOp, false });
+            mPlan.push_back({ mSorted[i].first, mSorted[j].first, mCrossOp, true });
+        });
 
-        std::vector<Tensor> newPool;
+        auto& newPool = mPops[mCurPopIdx ^= 1];
+        assert(&newPool != &pool);
+        newPool.Resize(mPlan.size(), pool.size_cols());
 
-        // elitism: keep top 1%
-        //for (size_t i=0; i < std::max<size_t>(1, n/100); ++i)
-        //    newPool.push_back( *pSorted[i].first );
+        // once per parent
+        mRowSums.resize(n);
+        for (size_t i=0; i < std::min(TOP_FOR_SELECTION_N, n); ++i)
+        {
+            const auto row = pool.RowView(mSorted[i].first);
+            mRowSums[mSorted[i].first] = { row.Sum(), row.SumSq(), calcAbsSum(row) };
+        }
 
-        // breed the top N among each other with some mutations
-        for (size_t i=0; i < TOP_FOR_SELECTION_N; ++i)
+        // then make them, each in its own row, with its own random streams
+        //  (keyed by the epoch), so they can be made in any order
+        auto makeChild = [&](size_t ci)
         {
-            const auto& c_i = *pSorted[i].first;
-            for (size_t j=i+1; j < (TOP_FOR_SELECTION_N-1); ++j)
+            AllocCounter::Scope trackAllocs;
+            const auto& cp = mPlan[ci];
+            auto child = newPool.RowView(ci);
+            const auto a = pool.RowView(cp.parentA);
+            const auto b = pool.RowView(cp.parentB);
+            const RandStream rsCross(RandDomain::EVO_CROSS, (uint32_t)epochIdx, (uint32_t)ci);
+            switch (cp.crossOp)
             {
-                const auto& c_j = *pSorted[j].first;
-                newPool.push_back(              uniformCrossOver(rng, c_i, c_j) );
-                newPool.push_back( mutateChromo(uniformCrossOver(rng, c_i, c_j)) );
-                const auto& c_k = *pSorted[j+1].first;
-                newPool.push_back(              uniformCrossOver(rng, c_i, c_k) );
-                newPool.push_back( mutateChromo(uniformCrossOver(rng, c_i, c_k)) );
+            case CrossOp::UNIFORM: uniformCrossOver(rsCross, child, a, b); break;
+            case CrossOp::BLOCK:   blockCrossOver(rsCross, child, a, b, mBlockStarts); break;
+            case CrossOp::KPOINT:  kPointCrossOver(rsCross, child, a, b, KPOINT_CUTS_N); break;
             }
-        }
+
+            if (cp.mutate)
+            {
+                // a child takes about half of its genes from each parent,
+                //  so its stats are those of the genes of both
+                const auto& sa = mRowSums[cp.parentA];
+                const auto& sb = mRowSums[cp.parentB];
+                const auto meanStddev = calcMeanAndStddevFromSums(
+                                            (sa.sum + sb.sum) * 0.5,
+                                            (sa.sumSq + sb.sumSq) * 0.5,
+                                            child.size());
+
+                const RandStream rs(RandDomain::EVO_MUTATE, (uint32_t)epochIdx, (uint32_t)ci);
+                //mutateScaled(rs, child, (SCALAR)0.2, (sa.absSum + sb.absSum) * 0.5 / (double)child.size());
+                mutateNormalDist(rs, child, (SCALAR)0.1, meanStddev);
+            }
+        };
+
+        if (pThPool)
+            pThPool->ParallelFor(0, mPlan.size(), 1, makeChild);
+        else
+            for (size_t ci=0; ci < mPlan.size(); ++ci)
+                makeChild(ci);
 
         return newPool;
     }
@@ -208,7 +489,7 @@ public:
     //==================================================================
     void LockViewBestPool(
             const std::function<void(
-                const std::vector<Tensor>&,
+                const PopulationMatrix&,
                 const std::vector<ParamsInfo>&
                 )>& func)
     {
@@ -217,21 +498,33 @@ public:
     }
 
 private:
+    // the parents of each couple of children (indices in mSorted)
+    template <typename F>
+    static constexpr void forEachCouple(F&& fn)
+    {
+        // breed the top N among each other
+        for (size_t i=0; i < TOP_FOR_SELECTION_N; ++i)
+            for (size_t j=i+1; j < (TOP_FOR_SELECTION_N-1); ++j)
+            {
+                fn(i, j);
+                fn(i, j+1);
+            }
+    }
+
     //==================================================================
-    void updateBestPool(
-            const std::vector<std::pair<const Tensor*, const ParamsInfo*>>& pSorted)
+    void updateBestPool(const PopulationMatrix& pool)
     {
         std::lock_guard<std::mutex> lock(mBestPoolMutex);
 
-        const auto n = std::min(TOP_FOR_REPORT_N, pSorted.size());
+        const auto n = std::min(TOP_FOR_REPORT_N, mSorted.size());
 
         // replace the best params list with the new best params
-        mBestPool.clear();
+        mBestPool.Resize(n, pool.size_cols());
         mBestPInfos.clear();
         for (size_t i=0; i < n; ++i)
         {
-            mBestPool.push_back( *pSorted[i].first );
-            mBestPInfos.push_back( *pSorted[i].second );
+            mBestPool.SetRow(i, pool.RowData(mSorted[i].first));
+            mBestPInfos.push_back( *mSorted[i].second );
         }
     }
 };
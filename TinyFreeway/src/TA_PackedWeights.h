@@ -0,0 +1,169 @@
+//==================================================================
+/// TA_PackedWeights.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_PACKEDWEIGHTS_H
+#define TA_PACKEDWEIGHTS_H
+
+#include <vector>
+#include <memory>
+#include <new>
+#include <cassert>
+#include <algorithm>
+#include "TA_TensorKernels.h"
+
+//==================================================================
+// Inference-only layout of the weights of a network (float only).
+// Each layer is split in panels of PACK_PANEL_W output columns. A panel
+//  holds the transposed block of weights (rowsN x PACK_PANEL_W, one
+//  64-byte line per input), followed by the PACK_PANEL_W biases.
+//  Columns past the layer width are padded with zeros.
+//
+// Packing and unpacking are plain copies, so going from the flat genome
+//  (same layout as SimpleNN_T::FlattenNN()) to the packed form and back
+//  gives back the exact same values.
+class PackedWeights
+{
+public:
+    static constexpr size_t ALIGN = 64;
+    static constexpr size_t W = PACK_PANEL_W;
+
+    struct LayerInfo
+    {
+        size_t rowsN   {}; // inputs
+        size_t colsN   {}; // outputs
+        size_t panelsN {};
+        size_t offset  {}; // in floats, from the start of the buffer
+        size_t PaddedColsN() const { return panelsN * W; }
+    };
+
+private:
+    struct AlignedDeleter
+    {
+        void operator()(float* p) const { ::operator delete[](p, std::align_val_t(ALIGN)); }
+    };
+    std::unique_ptr<float[], AlignedDeleter> mpData;
+    std::vector<LayerInfo> mLayers;
+    size_t                 mMaxPaddedColsN {};
+
+public:
+    PackedWeights() = default;
+    PackedWeights(PackedWeights&&) = default;
+    PackedWeights& operator=(PackedWeights&&) = default;
+
+    PackedWeights(const PackedWeights& other) { *this = other; }
+    PackedWeights& operator=(const PackedWeights& other)
+    {
+        if (this != &other)
+        {
+            mLayers = other.mLayers;
+            mMaxPaddedColsN = other.mMaxPaddedColsN;
+            mpData.reset();
+            if (const auto n = other.calcDataSize())
+            {
+                mpData.reset(new (std::align_val_t(ALIGN)) float[n]);
+                std::copy(other.mpData.get(), other.mpData.get() + n, mpData.get());
+            }
+        }
+        return *this;
+    }
+
+    explicit PackedWeights(const std::vector<size_t>& layerNs)
+    {
+        size_t totN = 0;
+        for (size_t i=0; i < layerNs.size()-1; ++i)
+        {
+            LayerInfo li;
+            li.rowsN   = layerNs[i];
+            li.colsN   = layerNs[i+1];
+            li.panelsN = (li.colsN + W - 1) / W;
+            li.offset  = totN;
+            totN += calcPackedSize(li.rowsN, li.colsN);
+            mMaxPaddedColsN = std::max(mMaxPaddedColsN, li.PaddedColsN());
+            mLayers.push_back(li);
+        }
+        mpData.reset(new (std::align_val_t(ALIGN)) float[totN]);
+        std::fill(mpData.get(), mpData.get() + totN, 0.f);
+    }
+
+    bool IsEmpty() const { return mLayers.empty(); }
+
+    const auto& GetLayers() const { return mLayers; }
+    const float* GetLayerData(size_t li) const { return mpData.get() + mLayers[li].offset; }
+    size_t GetMaxPaddedColsN() const { return mMaxPaddedColsN; }
+
+    // wei is row-major rowsN x colsN, bia is colsN
+    void PackLayer(size_t li, const float* pWei, const float* pBia)
+    {
+        const auto& l = mLayers[li];
+        packPanels(mpData.get() + l.offset, pWei, pBia, l.rowsN, l.colsN);
+    }
+
+    void UnpackLayer(size_t li, float* pWei, float* pBia) const
+    {
+        const auto& l = mLayers[li];
+        const auto* pPanel = mpData.get() + l.offset;
+        for (size_t p=0; p < l.panelsN; ++p, pPanel += (l.rowsN + 1) * W)
+        {
+            const auto c0 = p * W;
+            const auto cN = std::min(W, l.colsN - c0);
+            for (size_t r=0; r < l.rowsN; ++r)
+                std::copy(pPanel + r * W, pPanel + r * W + cN, pWei + r * l.colsN + c0);
+            std::copy(pPanel + l.rowsN * W, pPanel + l.rowsN * W + cN, pBia + c0);
+        }
+    }
+
+    // from/to the flat genome: for each layer, weights then biases
+    void PackFromFlat(const float* pFlat)
+    {
+        for (size_t li=0; li < mLayers.size(); ++li)
+        {
+            const auto& l = mLayers[li];
+            PackLayer(li, pFlat, pFlat + l.rowsN * l.colsN);
+            pFlat += l.rowsN * l.colsN + l.colsN;
+        }
+    }
+
+    void UnpackToFlat(float* pFlat) const
+    {
+        for (size_t li=0; li < mLayers.size(); ++li)
+        {
+            const auto& l = mLayers[li];
+            UnpackLayer(li, pFlat, pFlat + l.rowsN * l.colsN);
+            pFlat += l.rowsN * l.colsN + l.colsN;
+        }
+    }
+
+    // pRes must hold at least PaddedColsN() values
+    void LayerVecMul(size_t li, float* pRes, const float* pVec) const
+    {
+        const auto& l = mLayers[li];
+        TensorKernels::Get().PackedVecMulMat(pRes, pVec, GetLayerData(li), l.rowsN, l.panelsN);
+    }
+
+    // batch version, rows of A are the inputs, rows of res the outputs
+    void LayerMatMul(
+            size_t li,
+            float* pRes, size_t resStride,
+            const float* pA, size_t aStride, size_t M,
+            TensorKernels::EpilogueFn epilogue) const
+    {
+        const auto& l = mLayers[li];
+        TensorKernels::Get().PackedMatMulMat(
+            pRes, resStride, pA, aStride, M, GetLayerData(li), l.rowsN, l.colsN, epilogue);
+    }
+
+private:
+    size_t calcDataSize() const
+    {
+        if (mLayers.empty())
+            return 0;
+        const auto& l = mLayers.back();
+        return l.offset + calcPackedSize(l.rowsN, l.colsN);
+    }
+};
+
+#endif
@@ -0,0 +1,397 @@
+//==================================================================
+/// TA_Philox.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_PHILOX_H
+#define TA_PHILOX_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+#include "TA_SIMD.h"
+
+//==================================================================
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as
+//  1, 2, 3", 2011): a counter-based generator. A block of 4 random words
+//  is a pure function of a 128-bit counter and a 64-bit key, there's no
+//  state to carry from one number to the next.
+// So a stream (see RandStream) can be read from any position, by any
+//  thread, in any order, with the same results.
+//==================================================================
+namespace philox
+{
+static constexpr uint32_t M0 = 0xD2511F53;
+static constexpr uint32_t M1 = 0xCD9E8D57;
+static constexpr uint32_t W0 = 0x9E3779B9;
+static constexpr uint32_t W1 = 0xBB67AE85;
+static constexpr int      ROUNDS_N = 10;
+
+// one block, the reference version
+TA_FORCE_INLINE void genBlock(
+        uint32_t* pOut,
+        uint32_t blk,
+        const uint32_t* pIds,
+        const uint32_t* pKey)
+{
+    uint32_t x0 = blk, x1 = pIds[0], x2 = pIds[1], x3 = pIds[2];
+    auto k0 = pKey[0];
+    auto k1 = pKey[1];
+    for (int r=0; r < ROUNDS_N; ++r)
+    {
+        const auto p0 = (uint64_t)M0 * x0;
+        const auto p1 = (uint64_t)M1 * x2;
+        x0 = (uint32_t)(p1 >> 32) ^ x1 ^ k0;
+        x2 = (uint32_t)(p0 >> 32) ^ x3 ^ k1;
+        x1 = (uint32_t)p1;
+        x3 = (uint32_t)p0;
+        k0 += W0;
+        k1 += W1;
+    }
+    pOut[0] = x0;
+    pOut[1] = x1;
+    pOut[2] = x2;
+    pOut[3] = x3;
+}
+
+// blocks blk0 .. blk0+blocksN-1, with the same other counter words and key
+inline void genBlocks_Scalar(uint32_t* pOut, uint32_t blk0, size_t blocksN,
+        const uint32_t* pIds, const uint32_t* pKey)
+{
+    for (size_t i=0; i < blocksN; ++i)
+        genBlock(pOut + i*4, blk0 + (uint32_t)i, pIds, pKey);
+}
+
+// The SIMD versions do a block per lane, each word of the blocks in its
+//  own register. The 32 x 32 -> 64 bit products are done on the even
+//  and the odd lanes separately (mul_epu32), then blended back.
+//  The words are interleaved again on the way out.
+#ifdef TA_SIMD_X86
+// GCC 12 warns about its own AVX-512 integer intrinsics (PR 105593)
+#if defined(__GNUC__) && !defined(__clang__)
+# pragma GCC diagnostic push
+# pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// hi and lo 32 bits of a * m, per lane
+TA_TARGET_SSE42 TA_FORCE_INLINE void mulHiLo_SSE42(__m128i a, __m128i m, __m128i& hi, __m128i& lo)
+{
+    const auto ev = _mm_mul_epu32(a, m);
+    const auto od = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+    hi = _mm_blend_epi16(_mm_srli_epi64(ev, 32), od, 0xCC);
+    lo = _mm_blend_epi16(ev, _mm_slli_epi64(od, 32), 0xCC);
+}
+
+TA_TARGET_AVX2 TA_FORCE_INLINE void mulHiLo_AVX2(__m256i a, __m256i m, __m256i& hi, __m256i& lo)
+{
+    const auto ev = _mm256_mul_epu32(a, m);
+    const auto od = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), m);
+    hi = _mm256_blend_epi32(_mm256_srli_epi64(ev, 32), od, 0xAA);
+    lo = _mm256_blend_epi32(ev, _mm256_slli_epi64(od, 32), 0xAA);
+}
+
+TA_TARGET_AVX512 TA_FORCE_INLINE void mulHiLo_AVX512(__m512i a, __m512i m, __m512i& hi, __m512i& lo)
+{
+    const auto ev = _mm512_mul_epu32(a, m);
+    const auto od = _mm512_mul_epu32(_mm512_srli_epi64(a, 32), m);
+    hi = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(ev, 32), od);
+    lo = _mm512_mask_blend_epi32(0xAAAA, ev, _mm512_slli_epi64(od, 32));
+}
+
+TA_TARGET_SSE42 inline void genBlocks_SSE42(uint32_t* pOut, uint32_t blk0, size_t blocksN,
+        const uint32_t* pIds, const uint32_t* pKey)
+{
+    constexpr size_t L = 4;
+    const auto m0 = _mm_set1_epi32((int)M0);
+    const auto m1 = _mm_set1_epi32((int)M1);
+    size_t i = 0;
+    for (; i + L <= blocksN; i += L)
+    {
+        auto x0 = _mm_add_epi32(_mm_set1_epi32((int)(blk0 + (uint32_t)i)), _mm_setr_epi32(0, 1, 2, 3));
+        auto x1 = _mm_set1_epi32((int)pIds[0]);
+        auto x2 = _mm_set1_epi32((int)pIds[1]);
+        auto x3 = _mm_set1_epi32((int)pIds[2]);
+        auto k0 = pKey[0];
+        auto k1 = pKey[1];
+        for (int r=0; r < ROUNDS_N; ++r)
+        {
+            __m128i hi0, lo0, hi1, lo1;
+            mulHiLo_SSE42(x0, m0, hi0, lo0);
+            mulHiLo_SSE42(x2, m1, hi1, lo1);
+            x0 = _mm_xor_si128(_mm_xor_si128(hi1, x1), _mm_set1_epi32((int)k0));
+            x2 = _mm_xor_si128(_mm_xor_si128(hi0, x3), _mm_set1_epi32((int)k1));
+            x1 = lo1;
+            x3 = lo0;
+            k0 += W0;
+            k1 += W1;
+        }
+        // 4x4 transpose: a block per row
+        const auto t0 = _mm_unpacklo_epi32(x0, x1);
+        const auto t1 = _mm_unpacklo_epi32(x2, x3);
+        const auto t2 = _mm_unpackhi_epi32(x0, x1);
+        const auto t3 = _mm_unpackhi_epi32(x2, x3);
+        auto* pO = (__m128i*)(pOut + i*4);
+        _mm_storeu_si128(pO + 0, _mm_unpacklo_epi64(t0, t1));
+        _mm_storeu_si128(pO + 1, _mm_unpackhi_epi64(t0, t1));
+        _mm_storeu_si128(pO + 2, _mm_unpacklo_epi64(t2, t3));
+        _mm_storeu_si128(pO + 3, _mm_unpackhi_epi64(t2, t3));
+    }
+    genBlocks_Scalar(pOut + i*4, blk0 + (uint32_t)i, blocksN - i, pIds, pKey);
+}
+
+TA_TARGET_AVX2 inline void genBlocks_AVX2(uint32_t* pOut, uint32_t blk0, size_t blocksN,
+        const uint32_t* pIds, const uint32_t* pKey)
+{
+    constexpr size_t L = 8;
+    const auto m0 = _mm256_set1_epi32((int)M0);
+    const auto m1 = _mm256_set1_epi32((int)M1);
+    size_t i = 0;
+    for (; i + L <= blocksN; i += L)
+    {
+        auto x0 = _mm256_add_epi32(
+                    _mm256_set1_epi32((int)(blk0 + (uint32_t)i)),
+                    _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        auto x1 = _mm256_set1_epi32((int)pIds[0]);
+        auto x2 = _mm256_set1_epi32((int)pIds[1]);
+        auto x3 = _mm256_set1_epi32((int)pIds[2]);
+        auto k0 = pKey[0];
+        auto k1 = pKey[1];
+        for (int r=0; r < ROUNDS_N; ++r)
+        {
+            __m256i hi0, lo0, hi1, lo1;
+            mulHiLo_AVX2(x0, m0, hi0, lo0);
+            mulHiLo_AVX2(x2, m1, hi1, lo1);
+            x0 = _mm256_xor_si256(_mm256_xor_si256(hi1, x1), _mm256_set1_epi32((int)k0));
+            x2 = _mm256_xor_si256(_mm256_xor_si256(hi0, x3), _mm256_set1_epi32((int)k1));
+            x1 = lo1;
+            x3 = lo0;
+            k0 += W0;
+            k1 += W1;
+        }
+        // 4x4 transposes in each 128-bit half: blocks (0,1,2,3) and (4,5,6,7)
+        const auto t0 = _mm256_unpacklo_epi32(x0, x1);
+        const auto t1 = _mm256_unpacklo_epi32(x2, x3);
+        const auto t2 = _mm256_unpackhi_epi32(x0, x1);
+        const auto t3 = _mm256_unpackhi_epi32(x2, x3);
+        const auto b0 = _mm256_unpacklo_epi64(t0, t1); // blocks 0, 4
+        const auto b1 = _mm256_unpackhi_epi64(t0, t1); // blocks 1, 5
+        const auto b2 = _mm256_unpacklo_epi64(t2, t3); // blocks 2, 6
+        const auto b3 = _mm256_unpackhi_epi64(t2, t3); // blocks 3, 7
+        auto* pO = (__m256i*)(pOut + i*4);
+        _mm256_storeu_si256(pO + 0, _mm256_permute2x128_si256(b0, b1, 0x20));
+        _mm256_storeu_si256(pO + 1, _mm256_permute2x128_si256(b2, b3, 0x20));
+        _mm256_storeu_si256(pO + 2, _mm256_permute2x128_si256(b0, b1, 0x31));
+        _mm256_storeu_si256(pO + 3, _mm256_permute2x128_si256(b2, b3, 0x31));
+    }
+    genBlocks_SSE42(pOut + i*4, blk0 + (uint32_t)i, blocksN - i, pIds, pKey);
+}
+
+TA_TARGET_AVX512 inline void genBlocks_AVX512(uint32_t* pOut, uint32_t blk0, size_t blocksN,
+        const uint32_t* pIds, const uint32_t* pKey)
+{
+    constexpr size_t L = 16;
+    const auto m0 = _mm512_set1_epi32((int)M0);
+    const auto m1 = _mm512_set1_epi32((int)M1);
+    size_t i = 0;
+    for (; i + L <= blocksN; i += L)
+    {
+        auto x0 = _mm512_add_epi32(
+                    _mm512_set1_epi32((int)(blk0 + (uint32_t)i)),
+                    _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+        auto x1 = _mm512_set1_epi32((int)pIds[0]);
+        auto x2 = _mm512_set1_epi32((int)pIds[1]);
+        auto x3 = _mm512_set1_epi32((int)pIds[2]);
+        auto k0 = pKey[0];
+        auto k1 = pKey[1];
+        for (int r=0; r < ROUNDS_N; ++r)
+        {
+            __m512i hi0, lo0, hi1, lo1;
+            mulHiLo_AVX512(x0, m0, hi0, lo0);
+            mulHiLo_AVX512(x2, m1, hi1, lo1);
+            x0 = _mm512_xor_si512(_mm512_xor_si512(hi1, x1), _mm512_set1_epi32((int)k0));
+            x2 = _mm512_xor_si512(_mm512_xor_si512(hi0, x3), _mm512_set1_epi32((int)k1));
+            x1 = lo1;
+            x3 = lo0;
+            k0 += W0;
+            k1 += W1;
+        }
+        // (x0, x1) and (x2, x3) word pairs, 4 blocks per output register
+        const auto t0 = _mm512_unpacklo_epi32(x0, x1);
+        const auto t1 = _mm512_unpacklo_epi32(x2, x3);
+        const auto t2 = _mm512_unpackhi_epi32(x0, x1);
+        const auto t3 = _mm512_unpackhi_epi32(x2, x3);
+        const auto b0 = _mm512_unpacklo_epi64(t0, t1); // blocks 0, 4,  8, 12
+        const auto b1 = _mm512_unpackhi_epi64(t0, t1); // blocks 1, 5,  9, 13
+        const auto b2 = _mm512_unpacklo_epi64(t2, t3); // blocks 2, 6, 10, 14
+        const auto b3 = _mm512_unpackhi_epi64(t2, t3); // blocks 3, 7, 11, 15
+        // gather the 128-bit lanes: (0,1,2,3), (4,5,6,7), ...
+        const auto c0 = _mm512_shuffle_i32x4(b0, b1, 0x44); // 0, 4, 1, 5
+        const auto c1 = _mm512_shuffle_i32x4(b2, b3, 0x44); // 2, 6, 3, 7
+        const auto c2 = _mm512_shuffle_i32x4(b0, b1, 0xEE); // 8,12, 9,13
+        const auto c3 = _mm512_shuffle_i32x4(b2, b3, 0xEE); //10,14,11,15
+        auto* pO = pOut + i*4;
+        _mm512_storeu_si512(pO +  0, _mm512_shuffle_i32x4(c0, c1, 0x88));
+        _mm512_storeu_si512(pO + 16, _mm512_shuffle_i32x4(c0, c1, 0xDD));
+        _mm512_storeu_si512(pO + 32, _mm512_shuffle_i32x4(c2, c3, 0x88));
+        _mm512_storeu_si512(pO + 48, _mm512_shuffle_i32x4(c2, c3, 0xDD));
+    }
+    genBlocks_AVX2(pOut + i*4, blk0 + (uint32_t)i, blocksN - i, pIds, pKey);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+# pragma GCC diagnostic pop
+#endif
+#endif
+
+using GenBlocksFn = void (*)(uint32_t*, uint32_t, size_t, const uint32_t*, const uint32_t*);
+
+// the version for the current CPU (the outputs are the same for all)
+inline GenBlocksFn getGenBlocksFn()
+{
+    static const GenBlocksFn sFn = []() -> GenBlocksFn
+    {
+        switch (GetSIMDLevel())
+        {
+#ifdef TA_SIMD_X86
+        case SIMDLevel::AVX512: return genBlocks_AVX512;
+        case SIMDLevel::AVX2:   return genBlocks_AVX2;
+        case SIMDLevel::SSE42:  return genBlocks_SSE42;
+#endif
+        default:                return genBlocks_Scalar;
+        }
+    }();
+    return sFn;
+}
+
+// [0, 1) with 24 bits (all a float can hold)
+TA_FORCE_INLINE float toUnit(uint32_t x) { return (float)(x >> 8) * 0x1p-24f; }
+// (0, 1], for the log of Box-Muller
+TA_FORCE_INLINE float toUnitNZ(uint32_t x) { return (float)((x >> 8) + 1) * 0x1p-24f; }
+}
+
+//==================================================================
+// What a stream is used for, one value per use. It's the high word of the
+//  Philox key, so that the streams of two uses never overlap, whatever
+//  their keys and ids.
+enum class RandDomain : uint32_t
+{
+    NN_INIT = 1,    // initial parameters of a network, keyed by the seed
+    EVO_CROSS,      // crossover of a child, keyed by the epoch
+    EVO_MUTATE,     // mutation of a child, keyed by the epoch
+};
+
+//==================================================================
+// A stream of random 32-bit words, identified by its domain, a key (e.g.
+//  the epoch) and 3 ids (e.g. the child).
+//  Word i is word (i % 4) of the Philox block with counter
+//  (i / 4, id0, id1, id2) and key (key, domain), so any range of a stream
+//  can be generated on its own.
+class RandStream
+{
+    uint32_t mKey[2] {};
+    uint32_t mIds[3] {};
+
+public:
+    RandStream(RandDomain domain, uint32_t key, uint32_t id0, uint32_t id1=0, uint32_t id2=0)
+        : mKey{ key, (uint32_t)domain }
+        , mIds{ id0, id1, id2 }
+    {}
+
+    // the same stream with another last id, e.g. for a second use in the
+    //  same operator
+    RandStream Fork(uint32_t id2) const
+    {
+        auto rs = *this;
+        rs.mIds[2] = id2;
+        return rs;
+    }
+
+    // words [idx0, idx0+n)
+    void FillBits(uint32_t* pOut, size_t idx0, size_t n) const
+    {
+        if (!n)
+            return;
+        // whole blocks straight to the output, the ends via a block
+        size_t i = 0;
+        if (const auto off = idx0 & 3)
+        {
+            uint32_t blk[4];
+            genBlock(blk, idx0 / 4);
+            for (; i < n && off + i < 4; ++i)
+                pOut[i] = blk[off + i];
+        }
+        if (const auto blocksN = (n - i) / 4)
+        {
+            philox::getGenBlocksFn()(pOut + i, (uint32_t)((idx0 + i) / 4), blocksN, mIds, mKey);
+            i += blocksN * 4;
+        }
+        if (i < n)
+        {
+            uint32_t blk[4];
+            genBlock(blk, (idx0 + i) / 4);
+            for (size_t j=0; i < n; ++i, ++j)
+                pOut[i] = blk[j];
+        }
+    }
+
+    // uniforms in [0, 1) from the words [idx0, idx0+n). The words go
+    //  through a buffer, as the floats can't be written as uint32_t
+    void FillUniform(float* pOut, size_t idx0, size_t n) const
+    {
+        constexpr size_t CHUNK_N = 256;
+        uint32_t bits[CHUNK_N];
+        for (size_t i=0; i < n; i += CHUNK_N)
+        {
+            const auto cN = std::min(CHUNK_N, n - i);
+            FillBits(bits, idx0 + i, cN);
+            for (size_t j=0; j < cN; ++j)
+                pOut[i + j] = philox::toUnit(bits[j]);
+        }
+    }
+
+    uint32_t BitsAt(size_t idx) const
+    {
+        uint32_t blk[4];
+        genBlock(blk, idx / 4);
+        return blk[idx & 3];
+    }
+
+    float UniformAt(size_t idx) const { return philox::toUnit(BitsAt(idx)); }
+
+    // a standard normal per block (Box-Muller)
+    float NormalAt(size_t idx) const
+    {
+        uint32_t blk[4];
+        genBlock(blk, idx);
+        const auto r = std::sqrt(-2.f * std::log(philox::toUnitNZ(blk[0])));
+        return r * std::cos(6.2831853f * philox::toUnit(blk[1]));
+    }
+
+    // standard normals [idx0, idx0+n)
+    void FillNormal(float* pOut, size_t idx0, size_t n) const
+    {
+        constexpr size_t CHUNK_N = 64;
+        uint32_t blks[CHUNK_N * 4];
+        for (size_t i=0; i < n; i += CHUNK_N)
+        {
+            const auto cN = std::min(CHUNK_N, n - i);
+            philox::getGenBlocksFn()(blks, (uint32_t)(idx0 + i), cN, mIds, mKey);
+            for (size_t j=0; j < cN; ++j)
+            {
+                const auto r = std::sqrt(-2.f * std::log(philox::toUnitNZ(blks[j*4+0])));
+                pOut[i + j] = r * std::cos(6.2831853f * philox::toUnit(blks[j*4+1]));
+            }
+        }
+    }
+
+private:
+    void genBlock(uint32_t* pOut, size_t blk) const
+    {
+        philox::genBlock(pOut, (uint32_t)blk, mIds, mKey);
+    }
+};
+
+#endif
@@ -0,0 +1,118 @@
+//==================================================================
+/// TA_PopulationMatrix.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_POPULATIONMATRIX_H
+#define TA_POPULATIONMATRIX_H
+
+#include <cassert>
+#include <algorithm>
+#include <new>
+#if defined(__linux__)
+# include <sys/mman.h>
+#endif
+#include "TA_Tensor.h"
+
+//==================================================================
+// The parameters of a whole population in one block: one row per
+//  individual. Rows start on a 64-byte boundary (the stride is padded),
+//  so the row views work with the aligned SIMD paths.
+// Resizing to the same or a smaller size doesn't allocate, so a matrix
+//  reused from one generation to the next costs nothing.
+// Blocks of 2 MB or more are 2 MB aligned, and the kernel is asked to
+//  back them with transparent huge pages (Linux only, ignored elsewhere).
+template <typename T>
+class PopulationMatrixT
+{
+    static constexpr size_t ALIGN = 64;
+    static constexpr size_t HUGE_PAGE_SIZE = (size_t)2 << 20;
+    static constexpr size_t ROW_ALIGN_N = ALIGN / sizeof(T);
+
+    T*          mpData {};
+    size_t      mRowsN {};
+    size_t      mColsN {};
+    size_t      mStride {};
+    size_t      mCapacity {}; // in elements
+
+public:
+    using Tensor = TensorT<T>;
+
+    PopulationMatrixT() = default;
+    PopulationMatrixT(size_t rowsN, size_t colsN) { Resize(rowsN, colsN); }
+
+    PopulationMatrixT(const PopulationMatrixT& other) { *this = other; }
+    ~PopulationMatrixT() { freeBlock(); }
+
+    PopulationMatrixT& operator=(const PopulationMatrixT& other)
+    {
+        if (this != &other)
+        {
+            Resize(other.mRowsN, other.mColsN);
+            std::copy(other.mpData, other.mpData + mRowsN * mStride, mpData);
+        }
+        return *this;
+    }
+
+    // contents are not preserved
+    void Resize(size_t rowsN, size_t colsN)
+    {
+        const auto stride = (colsN + ROW_ALIGN_N - 1) / ROW_ALIGN_N * ROW_ALIGN_N;
+        const auto need = rowsN * stride;
+        if (need > mCapacity)
+        {
+            freeBlock();
+            mpData = allocBlock(need);
+            mCapacity = need;
+        }
+        mRowsN = rowsN;
+        mColsN = colsN;
+        mStride = stride;
+    }
+
+    bool   empty()     const { return mRowsN == 0; }
+    size_t size_rows() const { return mRowsN; }
+    size_t size_cols() const { return mColsN; }
+    size_t GetStride() const { return mStride; }
+
+          T* RowData(size_t i)       { assert(i < mRowsN); return mpData + i * mStride; }
+    const T* RowData(size_t i) const { assert(i < mRowsN); return mpData + i * mStride; }
+
+    // 1 x colsN tensors on the row, no copy
+    Tensor RowView(size_t i)       { return Tensor(1, mColsN, RowData(i), false); }
+    const Tensor RowView(size_t i) const { return Tensor(1, mColsN, RowData(i), false); }
+
+    void SetRow(size_t i, const T* pSrc) { std::copy(pSrc, pSrc + mColsN, RowData(i)); }
+
+private:
+    static size_t calcBlockAlign(size_t bytes)
+    {
+        return bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : ALIGN;
+    }
+
+    static T* allocBlock(size_t n)
+    {
+        const auto align = calcBlockAlign(n * sizeof(T));
+        const auto bytes = (n * sizeof(T) + align - 1) / align * align;
+        auto* p = ::operator new(bytes, std::align_val_t(align));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (align == HUGE_PAGE_SIZE)
+            madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+        return (T*)p;
+    }
+
+    void freeBlock()
+    {
+        if (mpData)
+            ::operator delete(mpData, std::align_val_t(calcBlockAlign(mCapacity * sizeof(T))));
+        mpData = nullptr;
+        mCapacity = 0;
+    }
+};
+
+using PopulationMatrix = PopulationMatrixT<SCALAR>;
+
+#endif
@@ -0,0 +1,143 @@
+//==================================================================
+/// TA_SIMD.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_SIMD_H
+#define TA_SIMD_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// NOTE: kernels are compiled for every instruction set that the compiler
+//  knows about, and the best one is picked at run-time, once.
+//  No special compiler flags (e.g. -mavx2) are required.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define TA_SIMD_X86
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+# define TA_SIMD_NEON
+# include <arm_neon.h>
+#endif
+
+// Per-function instruction set enabling (GCC/Clang). MSVC doesn't need it
+#if defined(TA_SIMD_X86) && (defined(__GNUC__) || defined(__clang__))
+# define TA_TARGET_SSE42  __attribute__((target("sse4.2")))
+# define TA_TARGET_AVX2   __attribute__((target("avx2,fma")))
+# define TA_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+# define TA_TARGET_SSE42
+# define TA_TARGET_AVX2
+# define TA_TARGET_AVX512
+#endif
+
+// For the small helpers that must end up inside the vectorized loops
+#if defined(_MSC_VER) && !defined(__clang__)
+# define TA_FORCE_INLINE __forceinline
+#else
+# define TA_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+//==================================================================
+enum class SIMDLevel : int
+{
+    SCALAR,
+    SSE42,
+    AVX2,   // AVX2 + FMA
+    AVX512, // AVX-512F
+    NEON,
+};
+
+//==================================================================
+inline const char* GetSIMDLevelName(SIMDLevel lev)
+{
+    switch (lev)
+    {
+    case SIMDLevel::SSE42:  return "SSE4.2";
+    case SIMDLevel::AVX2:   return "AVX2";
+    case SIMDLevel::AVX512: return "AVX-512";
+    case SIMDLevel::NEON:   return "NEON";
+    default:                return "Scalar";
+    }
+}
+
+//==================================================================
+inline SIMDLevel detectSIMDLevel()
+{
+#if defined(TA_SIMD_X86)
+# if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4] {};
+    __cpuid(regs, 0);
+    const auto maxLeaf = regs[0];
+
+    __cpuid(regs, 1);
+    const bool hasSSE42   = (regs[2] & (1 << 20)) != 0;
+    const bool hasFMA     = (regs[2] & (1 << 12)) != 0;
+    const bool hasOSXSAVE = (regs[2] & (1 << 27)) != 0;
+
+    bool hasAVX2 = false;
+    bool hasAVX512 = false;
+    if (maxLeaf >= 7 && hasOSXSAVE)
+    {
+        // the OS must also save the wider registers on context switch
+        const auto xcr0 = _xgetbv(0);
+        const bool osYMM = (xcr0 & 0x06) == 0x06;
+        const bool osZMM = (xcr0 & 0xe6) == 0xe6;
+
+        __cpuidex(regs, 7, 0);
+        hasAVX2   = osYMM && hasFMA && (regs[1] & (1 << 5)) != 0;
+        hasAVX512 = osZMM && hasAVX2 && (regs[1] & (1 << 16)) != 0;
+    }
+# else
+    __builtin_cpu_init();
+    const bool hasSSE42  = __builtin_cpu_supports("sse4.2");
+    const bool hasAVX2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool hasAVX512 = hasAVX2 && __builtin_cpu_supports("avx512f");
+# endif
+    if (hasAVX512) return SIMDLevel::AVX512;
+    if (hasAVX2)   return SIMDLevel::AVX2;
+    if (hasSSE42)  return SIMDLevel::SSE42;
+    return SIMDLevel::SCALAR;
+#elif defined(TA_SIMD_NEON)
+    return SIMDLevel::NEON;
+#else
+    return SIMDLevel::SCALAR;
+#endif
+}
+
+//==================================================================
+// The level in use, detected on the first call.
+// Setting the environment variable TA_SIMD to one of "scalar", "sse42",
+//  "avx2", "avx512" caps the level (useful to compare the paths)
+inline SIMDLevel GetSIMDLevel()
+{
+    static const SIMDLevel sLevel = []()
+    {
+        auto lev = detectSIMDLevel();
+        if (const char* pCap = std::getenv("TA_SIMD"))
+        {
+            auto cap = lev;
+            if (!strcmp(pCap, "scalar")) cap = SIMDLevel::SCALAR; else
+            if (!strcmp(pCap, "sse42"))  cap = SIMDLevel::SSE42;  else
+            if (!strcmp(pCap, "avx2"))   cap = SIMDLevel::AVX2;   else
+            if (!strcmp(pCap, "avx512")) cap = SIMDLevel::AVX512;
+
+            // NEON is all or nothing
+            if (lev == SIMDLevel::NEON)
+                lev = (cap == SIMDLevel::SCALAR ? cap : lev);
+            else
+                lev = (SIMDLevel)std::min((int)lev, (int)cap);
+        }
+        return lev;
+    }();
+    return sLevel;
+}
+
+#endif
@@ -17,7 +17,15 @@
 #include <cassert>
 #include <random>
 #include <numeric>
+#include <array>
+#include <cstdint>
+#include <type_traits>
+#include <stdexcept>
+#include <string>
 #include "TA_Tensor.h"
+#include "TA_PackedWeights.h"
+#include "TA_Activations.h"
+#include "TA_Philox.h"
 
 //==================================================================
 template <typename T>
@@ -29,16 +37,47 @@ public:
 private:
     struct Layer
     {
-        Tensor Wei;
-        Tensor Bia;
+        Tensor    Wei;
+        Tensor    Bia;
+        ActivType Act = ActivType::GELU;
     };
-    std::vector<Layer> mLs;
+    // fixed capacity, so that a view can be created without allocating
+    class LayersArray
+    {
+        static constexpr size_t MAX_LAYERS_N = 8;
+        std::array<Layer, MAX_LAYERS_N> mBuf;
+        size_t                          mN {};
+    public:
+        LayersArray() = default;
+        explicit LayersArray(size_t n) : mN(n)
+        {
+            if (n > MAX_LAYERS_N)
+                throw std::invalid_argument(
+                        "SimpleNN: " + std::to_string(n) + " layers, the most is " +
+                        std::to_string(MAX_LAYERS_N));
+        }
+              Layer& operator[](size_t i)       { assert(i < mN); return mBuf[i]; }
+        const Layer& operator[](size_t i) const { assert(i < mN); return mBuf[i]; }
+              Layer& back()       { return mBuf[mN-1]; }
+        const Layer& back() const { return mBuf[mN-1]; }
+        auto begin()       { return mBuf.begin(); }
+        auto begin() const { return mBuf.begin(); }
+        auto end()         { return mBuf.begin() + mN; }
+        auto end()   const { return mBuf.begin() + mN; }
+        size_t size() const { return mN; }
+    };
+    LayersArray mLs;
     size_t mMaxLenVecN {};
+    // inference copy of the weights, in SIMD-friendly layout (float only)
+    PackedWeights mPacked;
+
+    static constexpr bool IS_PACKABLE = std::is_same_v<T, float>;
 
 public:
     SimpleNN_T() = default;
 
-    SimpleNN_T(const std::vector<size_t>& layerNs)
+    // layerActs: the activation of each layer, if empty, all use GELU
+    SimpleNN_T(const std::vector<size_t>& layerNs, const std::vector<ActivType>& layerActs={})
         : mLs(layerNs.size()-1)
     {
         for (size_t i=0; i < layerNs.size()-1; ++i)
@@ -46,13 +85,44 @@ public:
             mLs[i].Wei = Tensor(layerNs[i], layerNs[i+1]);
             mLs[i].Bia = Tensor(1, layerNs[i+1]);
         }
+        setActivs(layerActs);
 
         mMaxLenVecN = *std::max_element(layerNs.begin(), layerNs.end());
     }
 
+    // Create a view on the parameters: the layers point directly into
+    //  params, nothing is allocated or copied. params must outlive the view.
+    // NOTE: packing the weights would be a copy, so a view has none and its
+    //  inference takes the plain SIMD kernels, which are slower. For many
+    //  passes on the same parameters, use a net created from parameters
+    //  (or reloaded with LoadParams()), which are packed.
+    static SimpleNN_T CreateView(
+            const Tensor& params,
+            const std::vector<size_t>& layerNs,
+            const std::vector<ActivType>& layerActs={})
+    {
+        assert(params.size() == CalcNNSize(layerNs));
+
+        SimpleNN_T nn;
+        nn.mLs = LayersArray(layerNs.size()-1);
+        const auto* ptr = params.data();
+        for (size_t i=0; i < layerNs.size()-1; ++i)
+        {
+            auto& l = nn.mLs[i];
+            l.Wei = Tensor(layerNs[i], layerNs[i+1], ptr, false); ptr += l.Wei.size();
+            l.Bia = Tensor(1, layerNs[i+1], ptr, false);          ptr += l.Bia.size();
+        }
+        nn.setActivs(layerActs);
+        nn.mMaxLenVecN = *std::max_element(layerNs.begin(), layerNs.end());
+        return nn;
+    }
+
     // create from parameters
-    SimpleNN_T(const Tensor& params, const std::vector<size_t>& layerNs)
-        : SimpleNN_T(layerNs)
+    SimpleNN_T(
+            const Tensor& params,
+            const std::vector<size_t>& layerNs,
+            const std::vector<ActivType>& layerActs={})
+        : SimpleNN_T(layerNs, layerActs)
     {
         assert(params.size() == CalcNNSize(layerNs));
 
@@ -62,41 +132,59 @@ public:
             l.Wei.LoadFromMem(ptr); ptr += l.Wei.size();
             l.Bia.LoadFromMem(ptr); ptr += l.Bia.size();
         }
+        buildPacked(layerNs);
     }
 
-    // create from random seed
-    SimpleNN_T(uint32_t seed, const std::vector<size_t>& layerNs)
-        : SimpleNN_T(layerNs)
+    // Replace the parameters of a net created from parameters, with the
+    //  same layout. Nothing is allocated, so a net can be reused for each
+    //  individual of a population
+    void LoadParams(const Tensor& params)
     {
-        std::random_device rd;
-        std::mt19937 gen( seed ? seed : rd() );
-        if (USE_XAVIER_INIT)
+        assert(params.size() == calcNNSize());
+
+        const auto* ptr = params.data();
+        for (size_t i=0; i < mLs.size(); ++i)
         {
-            // use Xavier initialization
-            const T SQRT_2 = (T)std::sqrt(2.0);
-            std::normal_distribution<T> dis((T)0.0, (T)1.0 / SQRT_2);
+            auto& l = mLs[i];
+            l.Wei.LoadFromMem(ptr); ptr += l.Wei.size();
+            l.Bia.LoadFromMem(ptr); ptr += l.Bia.size();
+            if constexpr (IS_PACKABLE)
+                if (!mPacked.IsEmpty())
+                    mPacked.PackLayer(i, l.Wei.data(), l.Bia.data());
+        }
+    }
 
-            // initialize weights and biases with random values
-            for (auto& l : mLs)
+    // create from random seed
+    SimpleNN_T(
+            uint32_t seed,
+            const std::vector<size_t>& layerNs,
+            const std::vector<ActivType>& layerActs={})
+        : SimpleNN_T(layerNs, layerActs)
+    {
+        // a stream per layer and kind of parameter (see TA_Philox.h), so
+        //  the values don't depend on the order in which they're made
+        const auto useSeed = seed ? seed : std::random_device{}();
+        for (size_t li=0; li < mLs.size(); ++li)
+        {
+            auto& l = mLs[li];
+            const RandStream rsWei(RandDomain::NN_INIT, useSeed, (uint32_t)li, 0);
+            const RandStream rsBia(RandDomain::NN_INIT, useSeed, (uint32_t)li, 1);
+            if (USE_XAVIER_INIT)
             {
-                l.Wei.ForEach([&](auto& x){ x = dis(gen); });
-                l.Bia.ForEach([&](auto& x){ x = dis(gen); });
+                // use Xavier initialization
+                const auto SCALE = (T)1.0 / (T)std::sqrt(2.0);
+                fillRandom(l.Wei, rsWei, true, SCALE);
+                fillRandom(l.Bia, rsBia, true, SCALE);
             }
-        }
-        else
-        {
-            // use random initialization
-            std::uniform_real_distribution<T> dis((T)-1.0, (T)1.0);
-
-            constexpr auto BIAS_SCALE = (T)0.1;
-
-            // initialize weights and biases with random values
-            for (auto& l : mLs)
+            else
             {
-                l.Wei.ForEach([&](auto& x){ x = dis(gen); });
-                l.Bia.ForEach([&](auto& x){ x = BIAS_SCALE * dis(gen); });
+                // use random initialization, in [-1, 1)
+                constexpr auto BIAS_SCALE = (T)0.1;
+                fillRandom(l.Wei, rsWei, false, (T)1.0);
+                fillRandom(l.Bia, rsBia, false, BIAS_SCALE);
             }
         }
+        buildPacked(layerNs);
     }
 
     // flatten to a 1D tensor
@@ -115,6 +203,8 @@ public:
         return flat;
     }
 
+    ActivType GetLayerActiv(size_t li) const { return mLs[li].Act; }
+
     static size_t CalcNNSize(const std::vector<size_t>& layerNs)
     {
         size_t size = 0;
@@ -123,28 +213,110 @@ public:
         return size;
     }
 private:
+    // normals (or uniforms in [-1, 1)) times sca, generated in bulk
+    static void fillRandom(Tensor& t, const RandStream& rs, bool isNormal, T sca)
+    {
+        constexpr size_t CHUNK_N = 256;
+        float vals[CHUNK_N];
+        auto* p = t.data();
+        const auto n = t.size();
+        for (size_t i=0; i < n; i += CHUNK_N)
+        {
+            const auto cN = std::min(CHUNK_N, n - i);
+            if (isNormal)
+            {
+                rs.FillNormal(vals, i, cN);
+                for (size_t j=0; j < cN; ++j)
+                    p[i+j] = (T)vals[j] * sca;
+            }
+            else
+            {
+                rs.FillUniform(vals, i, cN);
+                for (size_t j=0; j < cN; ++j)
+                    p[i+j] = ((T)vals[j] * 2 - 1) * sca;
+            }
+        }
+    }
+
     size_t calcNNSize() const
     {
         return std::accumulate(mLs.begin(), mLs.end(), (size_t)0,
             [](size_t sum, const Layer& l){ return sum + l.Wei.size() + l.Bia.size(); });
     }
+
+    void buildPacked(const std::vector<size_t>& layerNs)
+    {
+        if constexpr (IS_PACKABLE)
+        {
+            mPacked = PackedWeights(layerNs);
+            for (size_t i=0; i < mLs.size(); ++i)
+                mPacked.PackLayer(i, mLs[i].Wei.data(), mLs[i].Bia.data());
+        }
+    }
+
+    void setActivs(const std::vector<ActivType>& layerActs)
+    {
+        assert(layerActs.empty() || layerActs.size() == mLs.size());
+        for (size_t i=0; i < layerActs.size(); ++i)
+            mLs[i].Act = layerActs[i];
+    }
+
+    // the activation type is resolved once per layer, not per element
+    static void activ_vec(Tensor& v, ActivType act) { ActivateSpanRT(act, v.data(), v.size()); }
+
+    // inference on the packed weights, each layer output is padded to
+    //  the panel width, only the valid part goes to the next layer
+    void forwardPassPacked(Tensor& outs, const Tensor& ins) const
+    {
+        constexpr auto ALIGN = PackedWeights::ALIGN;
+        const auto bufN = mPacked.GetMaxPaddedColsN() + ALIGN / sizeof(T);
+        auto alignPtr = [](void* p){ return (T*)(((uintptr_t)p + ALIGN - 1) & ~(uintptr_t)(ALIGN - 1)); };
+        auto* pTempMem0 = alignPtr(alloca(bufN * sizeof(T)));
+        auto* pTempMem1 = alignPtr(alloca(bufN * sizeof(T)));
+
+        const auto& pls = mPacked.GetLayers();
+        const T* pIn = ins.data();
+        for (size_t i=0; i < pls.size(); ++i)
+        {
+            mPacked.LayerVecMul(i, pTempMem0, pIn);
+            auto tmp = Tensor::CreateVecView(pls[i].colsN, pTempMem0);
+            activ_vec(tmp, mLs[i].Act);
+            pIn = pTempMem0;
+            std::swap(pTempMem0, pTempMem1);
+        }
+        std::copy(pIn, pIn + outs.size(), outs.data());
+    }
+
+    // per-thread memory for the intermediate layers of a batch
+    static T* getBatchMem(size_t n)
+    {
+        thread_local std::vector<T> sMem;
+        if (sMem.size() < n)
+            sMem.resize(n);
+        return sMem.data();
+    }
+
 public:
+    // so that ForwardPassBatch() of up to batchN rows doesn't allocate
+    //  later on this thread
+    void ReserveBatch(size_t batchN) const
+    {
+        getBatchMem(batchN * mMaxLenVecN * 2);
+    }
+
     void ForwardPass(Tensor& outs, const Tensor& ins) const
     {
         assert(ins.size()  == mLs[0].Wei.size_rows() &&
                outs.size() == mLs.back().Wei.size_cols());
 
-        // define the activation function
-        auto activ_vec = [](auto& v)
+        if constexpr (IS_PACKABLE)
         {
-            v.ForEach([](auto& x) {
-                //x = T(1.0) / (T(1.0) + exp(-x)); // sigmoid
-                //x = tanh(x); // tanh
-                //x = std::max(T(0), x); // ReLU
-                //x = std::max(T(0.01)*x, x); // Leaky ReLU
-                x = x * T(0.5) * (T(1.0) + erf(x / sqrt(T(2.0)))); // GELU
-            });
-        };
+            if (!mPacked.IsEmpty())
+            {
+                forwardPassPacked(outs, ins);
+                return;
+            }
+        }
 
         auto* pTempMem0 = (T*)alloca(mMaxLenVecN * sizeof(T));
         auto* pTempMem1 = (T*)alloca(mMaxLenVecN * sizeof(T));
@@ -152,8 +324,7 @@ public:
         {
             auto tmp0 = Tensor::CreateVecView(mLs[0].Wei.size_cols(), pTempMem0);
             Vec_mul_Mat(tmp0, ins, mLs[0].Wei);
-            tmp0 += mLs[0].Bia;
-            activ_vec(tmp0);
+            tmp0.AddBiasActivate(mLs[0].Bia, mLs[0].Act);
         }
         for (size_t i=1; i < mLs.size()-1; ++i)
         {
@@ -161,16 +332,67 @@ public:
             auto tmp0 = Tensor::CreateVecView(mLs[i-1].Wei.size_cols(), pTempMem0);
             auto tmp1 = Tensor::CreateVecView(l.Wei.size_cols(), pTempMem1);
             Vec_mul_Mat(tmp1, tmp0, l.Wei);
-            tmp1 += l.Bia;
-            activ_vec(tmp1);
+            tmp1.AddBiasActivate(l.Bia, l.Act);
             std::swap(pTempMem0, pTempMem1);
         }
         {
             const auto& l = mLs.back();
             auto tmp0 = Tensor::CreateVecView(mLs[mLs.size()-2].Wei.size_cols(), pTempMem0);
             Vec_mul_Mat(outs, tmp0, l.Wei);
-            outs += l.Bia;
-            activ_vec(outs);
+            outs.AddBiasActivate(l.Bia, l.Act);
+        }
+    }
+
+    // Batched inference: each row of ins is an input vector and each row
+    //  of outs receives its output. Each layer is a blocked Mat * Mat with
+    //  bias and activation applied while the block is in cache.
+    //  Gives the same results as calling ForwardPass() on each row.
+    void ForwardPassBatch(Tensor& outs, const Tensor& ins) const
+    {
+        const auto batchN = ins.size_rows();
+        assert(ins.size_cols()  == mLs[0].Wei.size_rows() &&
+               outs.size_cols() == mLs.back().Wei.size_cols() &&
+               outs.size_rows() == batchN);
+
+        const auto stride = mMaxLenVecN;
+        auto* pTempMem0 = getBatchMem(batchN * stride * 2);
+        auto* pTempMem1 = pTempMem0 + batchN * stride;
+
+        if constexpr (IS_PACKABLE)
+        {
+            if (!mPacked.IsEmpty())
+            {
+                const T* pIn = ins.data();
+                auto inStride = ins.size_cols();
+                for (size_t i=0; i < mLs.size(); ++i)
+                {
+                    const bool isLast = (i == mLs.size()-1);
+                    auto* pOut = isLast ? outs.data() : pTempMem0;
+                    const auto outStride = isLast ? outs.size_cols() : stride;
+                    mPacked.LayerMatMul(i, pOut, outStride, pIn, inStride, batchN,
+                                        ActivKernels::Get().GetSpanFn(mLs[i].Act));
+                    pIn = pOut;
+                    inStride = outStride;
+                    std::swap(pTempMem0, pTempMem1);
+                }
+                return;
+            }
+        }
+
+        // generic path, contiguous temporaries of the exact layer width
+        const Tensor* pIn = &ins;
+        Tensor tmps[2];
+        for (size_t i=0; i < mLs.size(); ++i)
+        {
+            const auto& l = mLs[i];
+            const bool isLast = (i == mLs.size()-1);
+            auto& tmp = tmps[i & 1];
+            tmp = Tensor(batchN, l.Wei.size_cols(), (i & 1) ? pTempMem1 : pTempMem0, false);
+            auto& out = isLast ? outs : tmp;
+            Mat_mul_Mat(out, *pIn, l.Wei);
+            for (size_t r=0; r < batchN; ++r)
+                Tensor::CreateVecView(out.size_cols(), out[r]).AddBiasActivate(l.Bia, l.Act);
+            pIn = &tmp;
         }
     }
 };
@@ -9,33 +9,50 @@
 #ifndef TA_TENSOR_H
 #define TA_TENSOR_H
 
+#include <cassert>
 #include <cmath>
 #include <algorithm>
+#include <numeric>
 #include <vector>
-#include <functional>
+#include <new>
+#include <type_traits>
+#include "TA_TensorKernels.h"
+#include "TA_Activations.h"
 
 // NOTE: Currently, only supporting up to 2 dimensions
 //  enough for simple neural networks
 
 //==================================================================
+// The data is 64-byte aligned. It's either owned (heap), or it belongs to
+//  someone else (a view, e.g. on a row of a PopulationMatrix).
+//  Copies always go to the heap, so they can outlive the owner.
 template <typename T>
 class TensorT
 {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain numeric types");
+
+    static constexpr size_t ALIGN = 64;
+
     T*             mpData {};
     bool           mOwnsData {true};
     size_t         mRows {};
     size_t         mCols {};
 
+    struct UninitTag {};
+    TensorT(size_t rows, size_t cols, UninitTag)
+        : mpData(allocData(rows * cols))
+        , mRows(rows), mCols(cols)
+    {}
+
 public:
     TensorT() {}
     TensorT(size_t rows, size_t cols)
-        : mpData(new T[rows * cols])
-        , mRows(rows), mCols(cols)
+        : TensorT(rows, cols, UninitTag())
     {
         fill(T(0));
     }
     TensorT(size_t rows, size_t cols, T* pSrc, bool doCopy)
-        : mpData(doCopy ? new T[rows * cols] : pSrc)
+        : mpData(doCopy ? allocData(rows * cols) : pSrc)
         , mOwnsData(doCopy)
         , mRows(rows), mCols(cols)
     {
@@ -48,8 +65,7 @@ public:
 
     // copy constructor
     TensorT(const TensorT& other)
-        : mpData(new T[other.mRows * other.mCols])
-        , mRows(other.mRows), mCols(other.mCols)
+        : TensorT(other.mRows, other.mCols, UninitTag())
     {
         std::copy(other.mpData, other.mpData + mRows * mCols, mpData);
     }
@@ -60,7 +76,7 @@ public:
     ~TensorT()
     {
         if (mOwnsData)
-            delete[] mpData;
+            freeData(mpData);
     }
 
     void fill(const T& val) { std::fill(mpData, mpData + size(), val); }
@@ -82,8 +98,8 @@ public:
         if (this != &other)
         {
             if (mpData && mOwnsData)
-                delete[] mpData;
-            mpData = new T[other.mRows * other.mCols];
+                freeData(mpData);
+            mpData = allocData(other.mRows * other.mCols);
             mOwnsData = true;
             mRows = other.mRows;
             mCols = other.mCols;
@@ -98,7 +114,7 @@ public:
         if (this != &other)
         {
             if (mpData && mOwnsData)
-                delete[] mpData;
+                freeData(mpData);
             mpData = other.mpData;
             mRows = other.mRows;
             mCols = other.mCols;
@@ -145,33 +161,156 @@ public:
     size_t size_cols() const { return mCols; }
     size_t size() const { return mRows * mCols; }
 
-    void ForEach(const std::function<void(T&)>& func)
+    // Element-wise ops and reductions. The functions are templates, so
+    //  they get inlined in the loop, and the compiler can vectorize it.
+    //  The float versions of axpy, add-bias-activate and the sums go
+    //  through the SIMD kernels.
+    template <typename F>
+    void ForEach(F&& func)
     {
-        for (size_t i = 0; i < size(); ++i)
+        const auto n = size();
+        for (size_t i = 0; i < n; ++i)
             func(mpData[i]);
     }
 
+    // x = fn(x)
+    template <typename F>
+    TensorT& Map(F&& fn)
+    {
+        const auto n = size();
+        for (size_t i = 0; i < n; ++i)
+            mpData[i] = fn(mpData[i]);
+        return *this;
+    }
+
+    // x = fn(a, b), from the elements of a and b
+    template <typename F>
+    TensorT& ZipMap(const TensorT& a, const TensorT& b, F&& fn)
+    {
+        const auto n = size();
+        assert(n == a.size() && n == b.size());
+        const auto* pA = a.mpData;
+        const auto* pB = b.mpData;
+        for (size_t i = 0; i < n; ++i)
+            mpData[i] = fn(pA[i], pB[i]);
+        return *this;
+    }
+
+    // x += a * other
+    TensorT& Axpy(T a, const TensorT& other)
+    {
+        const auto n = size();
+        assert(n == other.size());
+        if constexpr (std::is_same_v<T, float>)
+            TensorKernels::Get().Axpy(mpData, a, other.mpData, n);
+        else
+            for (size_t i = 0; i < n; ++i)
+                mpData[i] += a * other.mpData[i];
+        return *this;
+    }
+
+    // x = activ(x + bias), bias has the same size
+    TensorT& AddBiasActivate(const TensorT& bias, ActivType act)
+    {
+        assert(size() == bias.size());
+        AddBiasActivateSpanRT(act, mpData, bias.mpData, size());
+        return *this;
+    }
+
+    T Sum() const
+    {
+        if constexpr (std::is_same_v<T, float>)
+            return TensorKernels::Get().Sum(mpData, size());
+        else
+            return std::accumulate(mpData, mpData + size(), T(0));
+    }
+
+    T SumSq() const
+    {
+        if constexpr (std::is_same_v<T, float>)
+            return TensorKernels::Get().SumSq(mpData, size());
+        else
+            return std::inner_product(mpData, mpData + size(), mpData, T(0));
+    }
+
     void LoadFromMem(const T* pSrc)
     {
         std::copy(pSrc, pSrc + size(), mpData);
     }
+
+private:
+    static T* allocData(size_t n)
+    {
+        return n ? (T*)::operator new[](n * sizeof(T), std::align_val_t(ALIGN)) : nullptr;
+    }
+    static void freeData(T* p)
+    {
+        if (p)
+            ::operator delete[](p, std::align_val_t(ALIGN));
+    }
 };
 
 // Very specific Vec * Mat multiplication used in neural networks
+// The float version goes through the SIMD kernels (see TA_TensorKernels.h
+//  for the tolerance vs the scalar path)
 inline auto Vec_mul_Mat = [](auto& resVec, const auto& vec, const auto& mat) -> auto&
 {
     assert(resVec.size() == mat.size_cols());
+    assert(vec.size() == mat.size_rows());
 
-    for (size_t i = 0; i < mat.size_cols(); ++i)
+    using ElemT = std::remove_cvref_t<decltype(*mat.data())>;
+    if constexpr (std::is_same_v<ElemT, float>)
     {
-        auto sum = decltype(vec(0,0))(0);
-        for (size_t j = 0; j < mat.size_rows(); ++j)
-            sum += vec(0,j) * mat(j, i);
-        resVec(0,i) = sum;
+        TensorKernels::Get().VecMulMat(
+            resVec.data(), vec.data(), mat.data(), mat.size_rows(), mat.size_cols());
+    }
+    else
+    {
+        for (size_t i = 0; i < mat.size_cols(); ++i)
+        {
+            auto sum = decltype(vec(0,0))(0);
+            for (size_t j = 0; j < mat.size_rows(); ++j)
+                sum += vec(0,j) * mat(j, i);
+            resVec(0,i) = sum;
+        }
     }
     return resVec;
 };
 
+// Mat * Mat multiplication, rows of matA are independent input vectors
+//  (e.g. a batch), so each row of the result matches Vec_mul_Mat
+inline auto Mat_mul_Mat = [](auto& resMat, const auto& matA, const auto& matB) -> auto&
+{
+    assert(resMat.size_rows() == matA.size_rows() &&
+           resMat.size_cols() == matB.size_cols() &&
+           matA.size_cols()   == matB.size_rows());
+
+    using ElemT = std::remove_cvref_t<decltype(*matB.data())>;
+    if constexpr (std::is_same_v<ElemT, float>)
+    {
+        TensorKernels::Get().MatMulMat(
+            resMat.data(), matA.data(), matB.data(),
+            matA.size_rows(), matA.size_cols(), matB.size_cols());
+    }
+    else
+    {
+        // i-k-j order, rows of matB are streamed contiguously
+        for (size_t i = 0; i < matA.size_rows(); ++i)
+        {
+            auto* pRes = resMat[i];
+            std::fill(pRes, pRes + resMat.size_cols(), ElemT(0));
+            for (size_t k = 0; k < matA.size_cols(); ++k)
+            {
+                const auto a = matA(i, k);
+                const auto* pB = matB[k];
+                for (size_t j = 0; j < matB.size_cols(); ++j)
+                    pRes[j] += a * pB[j];
+            }
+        }
+    }
+    return resMat;
+};
+
 // Set your scalar type here
 //using SCALAR = double;
 using SCALAR = float;
@@ -0,0 +1,1031 @@
+//==================================================================
+/// TA_TensorKernels.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_TENSORKERNELS_H
+#define TA_TENSORKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <new>
+#include <algorithm>
+#include "TA_SIMD.h"
+
+// Low-level float kernels used by TensorT, one version per instruction set.
+//
+// Vec * Mat: resVec[c] = sum_r vec[r] * mat[r][c], with mat row-major.
+//  All versions accumulate in the same order as the scalar reference
+//  (r = 0, 1, ...), one column per accumulator lane, so that each row of
+//  the matrix is streamed contiguously instead of walking down a column.
+//  SSE4.2 has no FMA and is bit-exact with the scalar path. AVX2, AVX-512
+//  and NEON fuse the multiply-add (one rounding instead of two) so, for
+//  each output, the difference from the scalar path is bounded by:
+//      |res_simd - res_ref| <= rowsN * FLT_EPSILON * sum_r |vec[r] * mat[r][c]|
+//  In practice this is a few ULPs for the layer sizes that we use.
+
+//==================================================================
+inline void vecMulMat_Scalar(
+        float* pRes, const float* pVec, const float* pMat, size_t rowsN, size_t colsN)
+{
+    for (size_t c=0; c < colsN; ++c)
+    {
+        float sum = 0;
+        for (size_t r=0; r < rowsN; ++r)
+            sum += pVec[r] * pMat[r * colsN + c];
+        pRes[c] = sum;
+    }
+}
+
+#ifdef TA_SIMD_X86
+//==================================================================
+TA_TARGET_SSE42 inline void vecMulMat_SSE42(
+        float* pRes, const float* pVec, const float* pMat, size_t rowsN, size_t colsN)
+{
+    size_t c = 0;
+    for (; c + 16 <= colsN; c += 16)
+    {
+        auto a0 = _mm_setzero_ps();
+        auto a1 = _mm_setzero_ps();
+        auto a2 = _mm_setzero_ps();
+        auto a3 = _mm_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+        {
+            const auto  v = _mm_set1_ps(pVec[r]);
+            const auto* p = pMat + r * colsN + c;
+            a0 = _mm_add_ps(a0, _mm_mul_ps(v, _mm_loadu_ps(p +  0)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(v, _mm_loadu_ps(p +  4)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(v, _mm_loadu_ps(p +  8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(v, _mm_loadu_ps(p + 12)));
+        }
+        _mm_storeu_ps(pRes + c +  0, a0);
+        _mm_storeu_ps(pRes + c +  4, a1);
+        _mm_storeu_ps(pRes + c +  8, a2);
+        _mm_storeu_ps(pRes + c + 12, a3);
+    }
+    for (; c + 4 <= colsN; c += 4)
+    {
+        auto a0 = _mm_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+            a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_set1_ps(pVec[r]), _mm_loadu_ps(pMat + r * colsN + c)));
+        _mm_storeu_ps(pRes + c, a0);
+    }
+    for (; c < colsN; ++c)
+    {
+        float sum = 0;
+        for (size_t r=0; r < rowsN; ++r)
+            sum += pVec[r] * pMat[r * colsN + c];
+        pRes[c] = sum;
+    }
+}
+
+//==================================================================
+TA_TARGET_AVX2 inline void vecMulMat_AVX2(
+        float* pRes, const float* pVec, const float* pMat, size_t rowsN, size_t colsN)
+{
+    size_t c = 0;
+    for (; c + 32 <= colsN; c += 32)
+    {
+        auto a0 = _mm256_setzero_ps();
+        auto a1 = _mm256_setzero_ps();
+        auto a2 = _mm256_setzero_ps();
+        auto a3 = _mm256_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+        {
+            const auto  v = _mm256_set1_ps(pVec[r]);
+            const auto* p = pMat + r * colsN + c;
+            a0 = _mm256_fmadd_ps(v, _mm256_loadu_ps(p +  0), a0);
+            a1 = _mm256_fmadd_ps(v, _mm256_loadu_ps(p +  8), a1);
+            a2 = _mm256_fmadd_ps(v, _mm256_loadu_ps(p + 16), a2);
+            a3 = _mm256_fmadd_ps(v, _mm256_loadu_ps(p + 24), a3);
+        }
+        _mm256_storeu_ps(pRes + c +  0, a0);
+        _mm256_storeu_ps(pRes + c +  8, a1);
+        _mm256_storeu_ps(pRes + c + 16, a2);
+        _mm256_storeu_ps(pRes + c + 24, a3);
+    }
+    for (; c + 8 <= colsN; c += 8)
+    {
+        auto a0 = _mm256_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+            a0 = _mm256_fmadd_ps(_mm256_set1_ps(pVec[r]), _mm256_loadu_ps(pMat + r * colsN + c), a0);
+        _mm256_storeu_ps(pRes + c, a0);
+    }
+    for (; c < colsN; ++c)
+    {
+        float sum = 0;
+        for (size_t r=0; r < rowsN; ++r)
+            sum = std::fma(pVec[r], pMat[r * colsN + c], sum);
+        pRes[c] = sum;
+    }
+}
+
+//==================================================================
+TA_TARGET_AVX512 inline void vecMulMat_AVX512(
+        float* pRes, const float* pVec, const float* pMat, size_t rowsN, size_t colsN)
+{
+    size_t c = 0;
+    for (; c + 64 <= colsN; c += 64)
+    {
+        auto a0 = _mm512_setzero_ps();
+        auto a1 = _mm512_setzero_ps();
+        auto a2 = _mm512_setzero_ps();
+        auto a3 = _mm512_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+        {
+            const auto  v = _mm512_set1_ps(pVec[r]);
+            const auto* p = pMat + r * colsN + c;
+            a0 = _mm512_fmadd_ps(v, _mm512_loadu_ps(p +  0), a0);
+            a1 = _mm512_fmadd_ps(v, _mm512_loadu_ps(p + 16), a1);
+            a2 = _mm512_fmadd_ps(v, _mm512_loadu_ps(p + 32), a2);
+            a3 = _mm512_fmadd_ps(v, _mm512_loadu_ps(p + 48), a3);
+        }
+        _mm512_storeu_ps(pRes + c +  0, a0);
+        _mm512_storeu_ps(pRes + c + 16, a1);
+        _mm512_storeu_ps(pRes + c + 32, a2);
+        _mm512_storeu_ps(pRes + c + 48, a3);
+    }
+    // remaining columns, 16 at a time, the last block is masked
+    for (; c < colsN; c += 16)
+    {
+        const auto remN = colsN - c;
+        const auto mask = (__mmask16)(remN >= 16 ? 0xffff : ((1u << remN) - 1));
+        auto a0 = _mm512_setzero_ps();
+        for (size_t r=0; r < rowsN; ++r)
+            a0 = _mm512_fmadd_ps(
+                    _mm512_set1_ps(pVec[r]),
+                    _mm512_maskz_loadu_ps(mask, pMat + r * colsN + c),
+                    a0);
+        _mm512_mask_storeu_ps(pRes + c, mask, a0);
+    }
+}
+#endif
+
+#ifdef TA_SIMD_NEON
+//==================================================================
+inline void vecMulMat_NEON(
+        float* pRes, const float* pVec, const float* pMat, size_t rowsN, size_t colsN)
+{
+    size_t c = 0;
+    for (; c + 16 <= colsN; c += 16)
+    {
+        auto a0 = vdupq_n_f32(0);
+        auto a1 = vdupq_n_f32(0);
+        auto a2 = vdupq_n_f32(0);
+        auto a3 = vdupq_n_f32(0);
+        for (size_t r=0; r < rowsN; ++r)
+        {
+            const auto  v = vdupq_n_f32(pVec[r]);
+            const auto* p = pMat + r * colsN + c;
+            a0 = vfmaq_f32(a0, v, vld1q_f32(p +  0));
+            a1 = vfmaq_f32(a1, v, vld1q_f32(p +  4));
+            a2 = vfmaq_f32(a2, v, vld1q_f32(p +  8));
+            a3 = vfmaq_f32(a3, v, vld1q_f32(p + 12));
+        }
+        vst1q_f32(pRes + c +  0, a0);
+        vst1q_f32(pRes + c +  4, a1);
+        vst1q_f32(pRes + c +  8, a2);
+        vst1q_f32(pRes + c + 12, a3);
+    }
+    for (; c + 4 <= colsN; c += 4)
+    {
+        auto a0 = vdupq_n_f32(0);
+        for (size_t r=0; r < rowsN; ++r)
+            a0 = vfmaq_f32(a0, vdupq_n_f32(pVec[r]), vld1q_f32(pMat + r * colsN + c));
+        vst1q_f32(pRes + c, a0);
+    }
+    for (; c < colsN; ++c)
+    {
+        float sum = 0;
+        for (size_t r=0; r < rowsN; ++r)
+            sum = std::fma(pVec[r], pMat[r * colsN + c], sum);
+        pRes[c] = sum;
+    }
+}
+#endif
+
+//==================================================================
+// Packed Vec * Mat, for weights pre-packed in panels of PACK_PANEL_W
+//  output columns (see TA_PackedWeights.h). Each panel is a 64-byte aligned
+//  block of rowsN x PACK_PANEL_W weights followed by PACK_PANEL_W biases,
+//  so that a layer streams its weights once, front to back.
+//  Output is written padded to panelsN * PACK_PANEL_W values, bias included.
+//  The bias is added after the sum, as in the non-packed path, so the
+//  same tolerance applies.
+static constexpr size_t PACK_PANEL_W = 16; // 64 bytes of floats
+
+inline void packedVecMulMat_Scalar(
+        float* pRes, const float* pVec, const float* pPanels, size_t rowsN, size_t panelsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    for (size_t p=0; p < panelsN; ++p, pPanels += (rowsN + 1) * W, pRes += W)
+    {
+        float sums[W] {};
+        for (size_t r=0; r < rowsN; ++r)
+            for (size_t k=0; k < W; ++k)
+                sums[k] += pVec[r] * pPanels[r * W + k];
+
+        const auto* pBia = pPanels + rowsN * W;
+        for (size_t k=0; k < W; ++k)
+            pRes[k] = sums[k] + pBia[k];
+    }
+}
+
+#ifdef TA_SIMD_X86
+//==================================================================
+TA_TARGET_SSE42 inline void packedVecMulMat_SSE42(
+        float* pRes, const float* pVec, const float* pPanels, size_t rowsN, size_t panelsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    for (size_t p=0; p < panelsN; ++p, pPanels += (rowsN + 1) * W, pRes += W)
+    {
+        auto a0 = _mm_setzero_ps();
+        auto a1 = _mm_setzero_ps();
+        auto a2 = _mm_setzero_ps();
+        auto a3 = _mm_setzero_ps();
+        const auto* pW = pPanels;
+        for (size_t r=0; r < rowsN; ++r, pW += W)
+        {
+            const auto v = _mm_set1_ps(pVec[r]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(v, _mm_load_ps(pW +  0)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(v, _mm_load_ps(pW +  4)));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(v, _mm_load_ps(pW +  8)));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(v, _mm_load_ps(pW + 12)));
+        }
+        _mm_storeu_ps(pRes +  0, _mm_add_ps(a0, _mm_load_ps(pW +  0)));
+        _mm_storeu_ps(pRes +  4, _mm_add_ps(a1, _mm_load_ps(pW +  4)));
+        _mm_storeu_ps(pRes +  8, _mm_add_ps(a2, _mm_load_ps(pW +  8)));
+        _mm_storeu_ps(pRes + 12, _mm_add_ps(a3, _mm_load_ps(pW + 12)));
+    }
+}
+
+//==================================================================
+TA_TARGET_AVX2 inline void packedVecMulMat_AVX2(
+        float* pRes, const float* pVec, const float* pPanels, size_t rowsN, size_t panelsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    const auto panelSize = (rowsN + 1) * W;
+
+    // 2 panels at a time, to keep 4 FMA chains in flight
+    size_t p = 0;
+    for (; p + 2 <= panelsN; p += 2, pPanels += panelSize * 2, pRes += W * 2)
+    {
+        auto a0 = _mm256_setzero_ps();
+        auto a1 = _mm256_setzero_ps();
+        auto a2 = _mm256_setzero_ps();
+        auto a3 = _mm256_setzero_ps();
+        const auto* pW0 = pPanels;
+        const auto* pW1 = pPanels + panelSize;
+        for (size_t r=0; r < rowsN; ++r, pW0 += W, pW1 += W)
+        {
+            const auto v = _mm256_set1_ps(pVec[r]);
+            a0 = _mm256_fmadd_ps(v, _mm256_load_ps(pW0 + 0), a0);
+            a1 = _mm256_fmadd_ps(v, _mm256_load_ps(pW0 + 8), a1);
+            a2 = _mm256_fmadd_ps(v, _mm256_load_ps(pW1 + 0), a2);
+            a3 = _mm256_fmadd_ps(v, _mm256_load_ps(pW1 + 8), a3);
+        }
+        _mm256_storeu_ps(pRes +  0, _mm256_add_ps(a0, _mm256_load_ps(pW0 + 0)));
+        _mm256_storeu_ps(pRes +  8, _mm256_add_ps(a1, _mm256_load_ps(pW0 + 8)));
+        _mm256_storeu_ps(pRes + 16, _mm256_add_ps(a2, _mm256_load_ps(pW1 + 0)));
+        _mm256_storeu_ps(pRes + 24, _mm256_add_ps(a3, _mm256_load_ps(pW1 + 8)));
+    }
+    if (p < panelsN)
+    {
+        auto a0 = _mm256_setzero_ps();
+        auto a1 = _mm256_setzero_ps();
+        const auto* pW = pPanels;
+        for (size_t r=0; r < rowsN; ++r, pW += W)
+        {
+            const auto v = _mm256_set1_ps(pVec[r]);
+            a0 = _mm256_fmadd_ps(v, _mm256_load_ps(pW + 0), a0);
+            a1 = _mm256_fmadd_ps(v, _mm256_load_ps(pW + 8), a1);
+        }
+        _mm256_storeu_ps(pRes + 0, _mm256_add_ps(a0, _mm256_load_ps(pW + 0)));
+        _mm256_storeu_ps(pRes + 8, _mm256_add_ps(a1, _mm256_load_ps(pW + 8)));
+    }
+}
+
+//==================================================================
+TA_TARGET_AVX512 inline void packedVecMulMat_AVX512(
+        float* pRes, const float* pVec, const float* pPanels, size_t rowsN, size_t panelsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    const auto panelSize = (rowsN + 1) * W;
+
+    // 4 panels at a time, to keep 4 FMA chains in flight
+    size_t p = 0;
+    for (; p + 4 <= panelsN; p += 4, pPanels += panelSize * 4, pRes += W * 4)
+    {
+        auto a0 = _mm512_setzero_ps();
+        auto a1 = _mm512_setzero_ps();
+        auto a2 = _mm512_setzero_ps();
+        auto a3 = _mm512_setzero_ps();
+        const auto* pW = pPanels;
+        for (size_t r=0; r < rowsN; ++r, pW += W)
+        {
+            const auto v = _mm512_set1_ps(pVec[r]);
+            a0 = _mm512_fmadd_ps(v, _mm512_load_ps(pW + panelSize * 0), a0);
+            a1 = _mm512_fmadd_ps(v, _mm512_load_ps(pW + panelSize * 1), a1);
+            a2 = _mm512_fmadd_ps(v, _mm512_load_ps(pW + panelSize * 2), a2);
+            a3 = _mm512_fmadd_ps(v, _mm512_load_ps(pW + panelSize * 3), a3);
+        }
+        _mm512_storeu_ps(pRes +  0, _mm512_add_ps(a0, _mm512_load_ps(pW + panelSize * 0)));
+        _mm512_storeu_ps(pRes + 16, _mm512_add_ps(a1, _mm512_load_ps(pW + panelSize * 1)));
+        _mm512_storeu_ps(pRes + 32, _mm512_add_ps(a2, _mm512_load_ps(pW + panelSize * 2)));
+        _mm512_storeu_ps(pRes + 48, _mm512_add_ps(a3, _mm512_load_ps(pW + panelSize * 3)));
+    }
+    for (; p < panelsN; ++p, pPanels += panelSize, pRes += W)
+    {
+        auto a0 = _mm512_setzero_ps();
+        const auto* pW = pPanels;
+        for (size_t r=0; r < rowsN; ++r, pW += W)
+            a0 = _mm512_fmadd_ps(_mm512_set1_ps(pVec[r]), _mm512_load_ps(pW), a0);
+        _mm512_storeu_ps(pRes, _mm512_add_ps(a0, _mm512_load_ps(pW)));
+    }
+}
+#endif
+
+#ifdef TA_SIMD_NEON
+//==================================================================
+inline void packedVecMulMat_NEON(
+        float* pRes, const float* pVec, const float* pPanels, size_t rowsN, size_t panelsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    for (size_t p=0; p < panelsN; ++p, pPanels += (rowsN + 1) * W, pRes += W)
+    {
+        auto a0 = vdupq_n_f32(0);
+        auto a1 = vdupq_n_f32(0);
+        auto a2 = vdupq_n_f32(0);
+        auto a3 = vdupq_n_f32(0);
+        const auto* pW = pPanels;
+        for (size_t r=0; r < rowsN; ++r, pW += W)
+        {
+            const auto v = vdupq_n_f32(pVec[r]);
+            a0 = vfmaq_f32(a0, v, vld1q_f32(pW +  0));
+            a1 = vfmaq_f32(a1, v, vld1q_f32(pW +  4));
+            a2 = vfmaq_f32(a2, v, vld1q_f32(pW +  8));
+            a3 = vfmaq_f32(a3, v, vld1q_f32(pW + 12));
+        }
+        vst1q_f32(pRes +  0, vaddq_f32(a0, vld1q_f32(pW +  0)));
+        vst1q_f32(pRes +  4, vaddq_f32(a1, vld1q_f32(pW +  4)));
+        vst1q_f32(pRes +  8, vaddq_f32(a2, vld1q_f32(pW +  8)));
+        vst1q_f32(pRes + 12, vaddq_f32(a3, vld1q_f32(pW + 12)));
+    }
+}
+#endif
+
+//==================================================================
+// Packs a row-major rowsN x colsN matrix (+ optional bias) into panels,
+//  in the layout used by the packed kernels. pDst must be 64-byte aligned
+//  and hold calcPackedSize(rowsN, colsN) floats.
+inline size_t calcPackedSize(size_t rowsN, size_t colsN)
+{
+    return ((colsN + PACK_PANEL_W - 1) / PACK_PANEL_W) * (rowsN + 1) * PACK_PANEL_W;
+}
+
+inline void packPanels(
+        float* pDst, const float* pWei, const float* pBia, size_t rowsN, size_t colsN)
+{
+    constexpr auto W = PACK_PANEL_W;
+    const auto panelsN = (colsN + W - 1) / W;
+    for (size_t p=0; p < panelsN; ++p, pDst += (rowsN + 1) * W)
+    {
+        const auto c0 = p * W;
+        const auto cN = std::min(W, colsN - c0);
+        for (size_t r=0; r < rowsN; ++r)
+        {
+            std::copy(pWei + r * colsN + c0, pWei + r * colsN + c0 + cN, pDst + r * W);
+            std::fill(pDst + r * W + cN, pDst + r * W + W, 0.f);
+        }
+        auto* pDstBia = pDst + rowsN * W;
+        if (pBia)
+            std::copy(pBia + c0, pBia + c0 + cN, pDstBia);
+        else
+            std::fill(pDstBia, pDstBia + cN, 0.f);
+        std::fill(pDstBia + cN, pDstBia + W, 0.f);
+    }
+}
+
+//==================================================================
+// Per-thread scratch memory, 64-byte aligned, for the kernels that need to
+//  repack their inputs. Grows as needed, never shrinks
+inline float* getKernelScratch(size_t n)
+{
+    struct Scratch
+    {
+        float*  p {};
+        size_t  n {};
+        ~Scratch() { ::operator delete[](p, std::align_val_t(64)); }
+    };
+    thread_local Scratch sScr;
+    if (n > sScr.n)
+    {
+        ::operator delete[](sScr.p, std::align_val_t(64));
+        sScr.p = new (std::align_val_t(64)) float[n];
+        sScr.n = n;
+    }
+    return sScr.p;
+}
+
+//==================================================================
+// Packed Mat * Mat micro-kernels: PACKED_MICRO_MR rows of A times one
+//  panel (K x PACK_PANEL_W + bias). Writes MR x PACK_PANEL_W results.
+//  For each output the accumulation order is the same as packedVecMulMat,
+//  so a batch gives the same results as running its rows one at a time.
+inline void packedMicro_Scalar(
+        float* pRes, size_t resStride, const float* pA, size_t aStride,
+        const float* pPanel, size_t K)
+{
+    packedVecMulMat_Scalar(pRes, pA, pPanel, K, 1);
+    (void)resStride; (void)aStride;
+}
+
+#ifdef TA_SIMD_X86
+//==================================================================
+// 2 x 16 (8 accumulators, out of the 16 XMM registers)
+TA_TARGET_SSE42 inline void packedMicro_SSE42(
+        float* pRes, size_t resStride, const float* pA, size_t aStride,
+        const float* pPanel, size_t K)
+{
+    constexpr auto W = PACK_PANEL_W;
+    auto a00 = _mm_setzero_ps(), a01 = _mm_setzero_ps(), a02 = _mm_setzero_ps(), a03 = _mm_setzero_ps();
+    auto a10 = _mm_setzero_ps(), a11 = _mm_setzero_ps(), a12 = _mm_setzero_ps(), a13 = _mm_setzero_ps();
+    const auto* pA0 = pA;
+    const auto* pA1 = pA + aStride;
+    const auto* pW = pPanel;
+    for (size_t k=0; k < K; ++k, pW += W)
+    {
+        const auto w0 = _mm_load_ps(pW +  0);
+        const auto w1 = _mm_load_ps(pW +  4);
+        const auto w2 = _mm_load_ps(pW +  8);
+        const auto w3 = _mm_load_ps(pW + 12);
+        const auto v0 = _mm_set1_ps(pA0[k]);
+        const auto v1 = _mm_set1_ps(pA1[k]);
+        a00 = _mm_add_ps(a00, _mm_mul_ps(v0, w0)); a01 = _mm_add_ps(a01, _mm_mul_ps(v0, w1));
+        a02 = _mm_add_ps(a02, _mm_mul_ps(v0, w2)); a03 = _mm_add_ps(a03, _mm_mul_ps(v0, w3));
+        a10 = _mm_add_ps(a10, _mm_mul_ps(v1, w0)); a11 = _mm_add_ps(a11, _mm_mul_ps(v1, w1));
+        a12 = _mm_add_ps(a12, _mm_mul_ps(v1, w2)); a13 = _mm_add_ps(a13, _mm_mul_ps(v1, w3));
+    }
+    const auto b0 = _mm_load_ps(pW +  0);
+    const auto b1 = _mm_load_ps(pW +  4);
+    const auto b2 = _mm_load_ps(pW +  8);
+    const auto b3 = _mm_load_ps(pW + 12);
+    auto* pR0 = pRes;
+    auto* pR1 = pRes + resStride;
+    _mm_storeu_ps(pR0 +  0, _mm_add_ps(a00, b0)); _mm_storeu_ps(pR0 +  4, _mm_add_ps(a01, b1));
+    _mm_storeu_ps(pR0 +  8, _mm_add_ps(a02, b2)); _mm_storeu_ps(pR0 + 12, _mm_add_ps(a03, b3));
+    _mm_storeu_ps(pR1 +  0, _mm_add_ps(a10, b0)); _mm_storeu_ps(pR1 +  4, _mm_add_ps(a11, b1));
+    _mm_storeu_ps(pR1 +  8, _mm_add_ps(a12, b2)); _mm_storeu_ps(pR1 + 12, _mm_add_ps(a13, b3));
+}
+
+//==================================================================
+// 4 x 16 (8 accumulators)
+TA_TARGET_AVX2 inline void packedMicro_AVX2(
+        float* pRes, size_t resStride, const float* pA, size_t aStride,
+        const float* pPanel, size_t K)
+{
+    constexpr auto W = PACK_PANEL_W;
+    auto a00 = _mm256_setzero_ps(), a01 = _mm256_setzero_ps();
+    auto a10 = _mm256_setzero_ps(), a11 = _mm256_setzero_ps();
+    auto a20 = _mm256_setzero_ps(), a21 = _mm256_setzero_ps();
+    auto a30 = _mm256_setzero_ps(), a31 = _mm256_setzero_ps();
+    const auto* pW = pPanel;
+    for (size_t k=0; k < K; ++k, pW += W)
+    {
+        const auto w0 = _mm256_load_ps(pW + 0);
+        const auto w1 = _mm256_load_ps(pW + 8);
+        auto v = _mm256_set1_ps(pA[aStride * 0 + k]);
+        a00 = _mm256_fmadd_ps(v, w0, a00); a01 = _mm256_fmadd_ps(v, w1, a01);
+        v = _mm256_set1_ps(pA[aStride * 1 + k]);
+        a10 = _mm256_fmadd_ps(v, w0, a10); a11 = _mm256_fmadd_ps(v, w1, a11);
+        v = _mm256_set1_ps(pA[aStride * 2 + k]);
+        a20 = _mm256_fmadd_ps(v, w0, a20); a21 = _mm256_fmadd_ps(v, w1, a21);
+        v = _mm256_set1_ps(pA[aStride * 3 + k]);
+        a30 = _mm256_fmadd_ps(v, w0, a30); a31 = _mm256_fmadd_ps(v, w1, a31);
+    }
+    const auto b0 = _mm256_load_ps(pW + 0);
+    const auto b1 = _mm256_load_ps(pW + 8);
+    _mm256_storeu_ps(pRes + resStride * 0 + 0, _mm256_add_ps(a00, b0));
+    _mm256_storeu_ps(pRes + resStride * 0 + 8, _mm256_add_ps(a01, b1));
+    _mm256_storeu_ps(pRes + resStride * 1 + 0, _mm256_add_ps(a10, b0));
+    _mm256_storeu_ps(pRes + resStride * 1 + 8, _mm256_add_ps(a11, b1));
+    _mm256_storeu_ps(pRes + resStride * 2 + 0, _mm256_add_ps(a20, b0));
+    _mm256_storeu_ps(pRes + resStride * 2 + 8, _mm256_add_ps(a21, b1));
+    _mm256_storeu_ps(pRes + resStride * 3 + 0, _mm256_add_ps(a30, b0));
+    _mm256_storeu_ps(pRes + resStride * 3 + 8, _mm256_add_ps(a31, b1));
+}
+
+//==================================================================
+// 8 x 16 (8 accumulators)
+TA_TARGET_AVX512 inline void packedMicro_AVX512(
+        float* pRes, size_t resStride, const float* pA, size_t aStride,
+        const float* pPanel, size_t K)
+{
+    constexpr auto W = PACK_PANEL_W;
+    __m512 acc[8];
+    for (auto& a : acc)
+        a = _mm512_setzero_ps();
+
+    const auto* pW = pPanel;
+    for (size_t k=0; k < K; ++k, pW += W)
+    {
+        const auto w = _mm512_load_ps(pW);
+        for (size_t i=0; i < 8; ++i)
+            acc[i] = _mm512_fmadd_ps(_mm512_set1_ps(pA[aStride * i + k]), w, acc[i]);
+    }
+    const auto b = _mm512_load_ps(pW);
+    for (size_t i=0; i < 8; ++i)
+        _mm512_storeu_ps(pRes + resStride * i, _mm512_add_ps(acc[i], b));
+}
+#endif
+
+#ifdef TA_SIMD_NEON
+//==================================================================
+// 4 x 16 (16 accumulators, out of the 32 Q registers)
+inline void packedMicro_NEON(
+        float* pRes, size_t resStride, const float* pA, size_t aStride,
+        const float* pPanel, size_t K)
+{
+    constexpr auto W = PACK_PANEL_W;
+    float32x4_t acc[4][4];
+    for (auto& row : acc)
+        for (auto& a : row)
+            a = vdupq_n_f32(0);
+
+    const auto* pW = pPanel;
+    for (size_t k=0; k < K; ++k, pW += W)
+    {
+        const float32x4_t w[4] = { vld1q_f32(pW), vld1q_f32(pW + 4), vld1q_f32(pW + 8), vld1q_f32(pW + 12) };
+        for (size_t i=0; i < 4; ++i)
+        {
+            const auto v = vdupq_n_f32(pA[aStride * i + k]);
+            for (size_t j=0; j < 4; ++j)
+                acc[i][j] = vfmaq_f32(acc[i][j], v, w[j]);
+        }
+    }
+    for (size_t i=0; i < 4; ++i)
+        for (size_t j=0; j < 4; ++j)
+            vst1q_f32(pRes + resStride * i + j * 4, vaddq_f32(acc[i][j], vld1q_f32(pW + j * 4)));
+}
+#endif
+
+//==================================================================
+// Reductions and element-wise ops on spans.
+// Sums use 16 partial sums (element i goes to sum i % 16), then add the
+//  halves together (8, 4, 2, 1). All the versions follow this order, so
+//  the results only differ where a compiler fuses the multiply-add of the
+//  sum of squares. The 16 partial sums are also more accurate than a
+//  single running sum on long spans.
+template <bool SQ>
+inline float sumSpan_Scalar(const float* p, size_t n)
+{
+    float acc[16] {};
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        for (size_t j=0; j < 16; ++j)
+            acc[j] += SQ ? p[i+j] * p[i+j] : p[i+j];
+    for (size_t j=0; i + j < n; ++j)
+        acc[j] += SQ ? p[i+j] * p[i+j] : p[i+j];
+
+    for (size_t w=8; w; w /= 2)
+        for (size_t j=0; j < w; ++j)
+            acc[j] += acc[j+w];
+    return acc[0];
+}
+
+// y += a * x
+inline void axpy_Scalar(float* pY, float a, const float* pX, size_t n)
+{
+    for (size_t i=0; i < n; ++i)
+        pY[i] += a * pX[i];
+}
+
+#ifdef TA_SIMD_X86
+//==================================================================
+TA_TARGET_SSE42 inline float hsum4_SSE42(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));                     // j + 2
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1,1,1,1))); // j + 1
+    return _mm_cvtss_f32(v);
+}
+
+template <bool SQ>
+TA_TARGET_SSE42 TA_FORCE_INLINE __m128 sumLoad_SSE42(const float* p)
+{
+    const auto v = _mm_loadu_ps(p);
+    return SQ ? _mm_mul_ps(v, v) : v;
+}
+
+template <bool SQ>
+TA_TARGET_SSE42 inline float sumSpan_SSE42(const float* p, size_t n)
+{
+    __m128 acc[4] { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        for (size_t j=0; j < 4; ++j)
+            acc[j] = _mm_add_ps(acc[j], sumLoad_SSE42<SQ>(p + i + j * 4));
+    if (i < n)
+    {
+        alignas(16) float tail[16] {};
+        std::copy(p + i, p + n, tail);
+        for (size_t j=0; j < 4; ++j)
+            acc[j] = _mm_add_ps(acc[j], sumLoad_SSE42<SQ>(tail + j * 4));
+    }
+    acc[0] = _mm_add_ps(acc[0], acc[2]); // j + 8
+    acc[1] = _mm_add_ps(acc[1], acc[3]);
+    acc[0] = _mm_add_ps(acc[0], acc[1]); // j + 4
+    return hsum4_SSE42(acc[0]);
+}
+
+TA_TARGET_SSE42 inline void axpy_SSE42(float* pY, float a, const float* pX, size_t n)
+{
+    const auto va = _mm_set1_ps(a);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(pY + i, _mm_add_ps(_mm_loadu_ps(pY + i), _mm_mul_ps(va, _mm_loadu_ps(pX + i))));
+    for (; i < n; ++i)
+        pY[i] += a * pX[i];
+}
+
+//==================================================================
+template <bool SQ>
+TA_TARGET_AVX2 TA_FORCE_INLINE __m256 sumLoad_AVX2(const float* p)
+{
+    const auto v = _mm256_loadu_ps(p);
+    return SQ ? _mm256_mul_ps(v, v) : v;
+}
+
+template <bool SQ>
+TA_TARGET_AVX2 inline float sumSpan_AVX2(const float* p, size_t n)
+{
+    auto acc0 = _mm256_setzero_ps();
+    auto acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_add_ps(acc0, sumLoad_AVX2<SQ>(p + i));
+        acc1 = _mm256_add_ps(acc1, sumLoad_AVX2<SQ>(p + i + 8));
+    }
+    if (i < n)
+    {
+        alignas(32) float tail[16] {};
+        std::copy(p + i, p + n, tail);
+        acc0 = _mm256_add_ps(acc0, sumLoad_AVX2<SQ>(tail));
+        acc1 = _mm256_add_ps(acc1, sumLoad_AVX2<SQ>(tail + 8));
+    }
+    acc0 = _mm256_add_ps(acc0, acc1); // j + 8
+    const auto v = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1)); // j + 4
+    return hsum4_SSE42(v);
+}
+
+TA_TARGET_AVX2 inline void axpy_AVX2(float* pY, float a, const float* pX, size_t n)
+{
+    const auto va = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(pY + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(pX + i), _mm256_loadu_ps(pY + i)));
+    for (; i < n; ++i)
+        pY[i] = std::fma(a, pX[i], pY[i]);
+}
+
+//==================================================================
+template <bool SQ>
+TA_TARGET_AVX512 inline float sumSpan_AVX512(const float* p, size_t n)
+{
+    auto acc = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const auto v = _mm512_loadu_ps(p + i);
+        acc = _mm512_add_ps(acc, SQ ? _mm512_mul_ps(v, v) : v);
+    }
+    if (i < n)
+    {
+        const auto mask = (__mmask16)((1u << (n - i)) - 1);
+        const auto v = _mm512_maskz_loadu_ps(mask, p + i);
+        acc = _mm512_add_ps(acc, SQ ? _mm512_mul_ps(v, v) : v);
+    }
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, acc);
+    const auto v0 = _mm_add_ps(_mm_load_ps(lanes + 0), _mm_load_ps(lanes +  8)); // j + 8
+    const auto v1 = _mm_add_ps(_mm_load_ps(lanes + 4), _mm_load_ps(lanes + 12));
+    return hsum4_SSE42(_mm_add_ps(v0, v1)); // j + 4
+}
+
+TA_TARGET_AVX512 inline void axpy_AVX512(float* pY, float a, const float* pX, size_t n)
+{
+    const auto va = _mm512_set1_ps(a);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(pY + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(pX + i), _mm512_loadu_ps(pY + i)));
+    if (i < n)
+    {
+        const auto mask = (__mmask16)((1u << (n - i)) - 1);
+        const auto y = _mm512_maskz_loadu_ps(mask, pY + i);
+        const auto x = _mm512_maskz_loadu_ps(mask, pX + i);
+        _mm512_mask_storeu_ps(pY + i, mask, _mm512_fmadd_ps(va, x, y));
+    }
+}
+#endif
+
+#ifdef TA_SIMD_NEON
+//==================================================================
+template <bool SQ>
+TA_FORCE_INLINE float32x4_t sumLoad_NEON(const float* p)
+{
+    const auto v = vld1q_f32(p);
+    return SQ ? vmulq_f32(v, v) : v;
+}
+
+template <bool SQ>
+inline float sumSpan_NEON(const float* p, size_t n)
+{
+    float32x4_t acc[4] { vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0), vdupq_n_f32(0) };
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        for (size_t j=0; j < 4; ++j)
+            acc[j] = vaddq_f32(acc[j], sumLoad_NEON<SQ>(p + i + j * 4));
+    if (i < n)
+    {
+        alignas(16) float tail[16] {};
+        std::copy(p + i, p + n, tail);
+        for (size_t j=0; j < 4; ++j)
+            acc[j] = vaddq_f32(acc[j], sumLoad_NEON<SQ>(tail + j * 4));
+    }
+    acc[0] = vaddq_f32(acc[0], acc[2]); // j + 8
+    acc[1] = vaddq_f32(acc[1], acc[3]);
+    acc[0] = vaddq_f32(acc[0], acc[1]); // j + 4
+    const auto v2 = vadd_f32(vget_low_f32(acc[0]), vget_high_f32(acc[0])); // j + 2
+    return vget_lane_f32(v2, 0) + vget_lane_f32(v2, 1);
+}
+
+inline void axpy_NEON(float* pY, float a, const float* pX, size_t n)
+{
+    const auto va = vdupq_n_f32(a);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(pY + i, vfmaq_f32(vld1q_f32(pY + i), va, vld1q_f32(pX + i)));
+    for (; i < n; ++i)
+        pY[i] = std::fma(a, pX[i], pY[i]);
+}
+#endif
+
+//==================================================================
+// Blend by a bitmask: res[i] = bit i ? b[i] : a[i], where bit i is bit
+//  (i % 32) of word (i / 32). E.g. a uniform crossover, with 32 choices
+//  per random word. The lanes of a vector take consecutive bits of a word.
+inline void blendBits_Scalar(
+        float* pRes, const float* pA, const float* pB, const uint32_t* pBits, size_t n)
+{
+    for (size_t i=0; i < n; ++i)
+        pRes[i] = ((pBits[i >> 5] >> (i & 31)) & 1) ? pB[i] : pA[i];
+}
+
+#ifdef TA_SIMD_X86
+TA_TARGET_SSE42 inline void blendBits_SSE42(
+        float* pRes, const float* pA, const float* pB, const uint32_t* pBits, size_t n)
+{
+    const auto sel = _mm_setr_epi32(1, 2, 4, 8);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const auto word = pBits[i >> 5];
+        for (size_t j=0; j < 32; j += 4)
+        {
+            const auto bits = _mm_set1_epi32((int)((word >> j) & 0xf));
+            const auto mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(bits, sel), sel));
+            _mm_storeu_ps(pRes + i + j,
+                _mm_blendv_ps(_mm_loadu_ps(pA + i + j), _mm_loadu_ps(pB + i + j), mask));
+        }
+    }
+    blendBits_Scalar(pRes + i, pA + i, pB + i, pBits + (i >> 5), n - i);
+}
+
+TA_TARGET_AVX2 inline void blendBits_AVX2(
+        float* pRes, const float* pA, const float* pB, const uint32_t* pBits, size_t n)
+{
+    const auto sel = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const auto word = pBits[i >> 5];
+        for (size_t j=0; j < 32; j += 8)
+        {
+            const auto bits = _mm256_set1_epi32((int)((word >> j) & 0xff));
+            const auto mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(bits, sel), sel));
+            _mm256_storeu_ps(pRes + i + j,
+                _mm256_blendv_ps(_mm256_loadu_ps(pA + i + j), _mm256_loadu_ps(pB + i + j), mask));
+        }
+    }
+    blendBits_Scalar(pRes + i, pA + i, pB + i, pBits + (i >> 5), n - i);
+}
+
+TA_TARGET_AVX512 inline void blendBits_AVX512(
+        float* pRes, const float* pA, const float* pB, const uint32_t* pBits, size_t n)
+{
+    // the bits are the mask registers
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const auto mask = (__mmask16)(pBits[i >> 5] >> (i & 16));
+        _mm512_storeu_ps(pRes + i,
+            _mm512_mask_blend_ps(mask, _mm512_loadu_ps(pA + i), _mm512_loadu_ps(pB + i)));
+    }
+    if (i < n)
+    {
+        const auto lenMask = (__mmask16)((1u << (n - i)) - 1);
+        const auto mask = (__mmask16)(pBits[i >> 5] >> (i & 16));
+        const auto a = _mm512_maskz_loadu_ps(lenMask, pA + i);
+        const auto b = _mm512_maskz_loadu_ps(lenMask, pB + i);
+        _mm512_mask_storeu_ps(pRes + i, lenMask, _mm512_mask_blend_ps(mask, a, b));
+    }
+}
+#endif
+
+#ifdef TA_SIMD_NEON
+inline void blendBits_NEON(
+        float* pRes, const float* pA, const float* pB, const uint32_t* pBits, size_t n)
+{
+    const uint32_t selArr[4] { 1, 2, 4, 8 };
+    const auto sel = vld1q_u32(selArr);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        const auto word = pBits[i >> 5];
+        for (size_t j=0; j < 32; j += 4)
+        {
+            const auto mask = vtstq_u32(vdupq_n_u32((word >> j) & 0xf), sel);
+            vst1q_f32(pRes + i + j, vbslq_f32(mask, vld1q_f32(pB + i + j), vld1q_f32(pA + i + j)));
+        }
+    }
+    blendBits_Scalar(pRes + i, pA + i, pB + i, pBits + (i >> 5), n - i);
+}
+#endif
+
+//==================================================================
+// Table of the kernels selected for the current CPU
+struct TensorKernels
+{
+    using VecMulMatFn = void (*)(float*, const float*, const float*, size_t, size_t);
+    using PackedMicroFn = void (*)(float*, size_t, const float*, size_t, const float*, size_t);
+    // applied to each finished row of a Mat * Mat (e.g. the activation)
+    using EpilogueFn = void (*)(float*, size_t);
+    using SumFn = float (*)(const float*, size_t);
+    using AxpyFn = void (*)(float*, float, const float*, size_t);
+    using BlendBitsFn = void (*)(float*, const float*, const float*, const uint32_t*, size_t);
+
+    VecMulMatFn     VecMulMat       = vecMulMat_Scalar;
+    VecMulMatFn     PackedVecMulMat = packedVecMulMat_Scalar;
+    PackedMicroFn   PackedMicro     = packedMicro_Scalar;
+    size_t          PackedMicroMR   = 1;
+    SumFn           Sum             = sumSpan_Scalar<false>;
+    SumFn           SumSq           = sumSpan_Scalar<true>;
+    AxpyFn          Axpy            = axpy_Scalar;
+    BlendBitsFn     BlendBits       = blendBits_Scalar;
+
+    static const TensorKernels& Get()
+    {
+        static const TensorKernels sKern(GetSIMDLevel());
+        return sKern;
+    }
+
+    // res (M x colsN) = A (M x K) * packed (K x colsN) + packed bias
+    // Blocked so that a block of MC rows of A stays in cache while each
+    //  panel (K x 16, in L1 for our layer sizes) is applied to it.
+    //  K is not blocked, layers are at most a few hundred wide.
+    void PackedMatMulMat(
+            float* pRes, size_t resStride,
+            const float* pA, size_t aStride, size_t M,
+            const float* pPanels, size_t K, size_t colsN,
+            EpilogueFn epilogue = nullptr) const
+    {
+        constexpr size_t W = PACK_PANEL_W;
+        constexpr size_t MC = 64;
+        const auto panelsN = (colsN + W - 1) / W;
+        const auto panelSize = (K + 1) * W;
+        const auto MR = PackedMicroMR;
+
+        // MR (up to 8) rows of a partial panel, or a leftover row of 8 panels
+        constexpr size_t TILE_PANELS_N = 8;
+        alignas(64) float tile[TILE_PANELS_N * W];
+
+        for (size_t m0=0; m0 < M; m0 += MC)
+        {
+            const auto mEnd = std::min(M, m0 + MC);
+            // rows that go through the micro-kernel, in groups of MR
+            const auto mMicroEnd = m0 + (mEnd - m0) / MR * MR;
+            for (size_t p=0; p < panelsN; ++p)
+            {
+                const auto* pPanel = pPanels + p * panelSize;
+                const auto c0 = p * W;
+                const auto cN = std::min(W, colsN - c0);
+
+                for (size_t i=m0; i < mMicroEnd; i += MR)
+                {
+                    const auto* pAi = pA + i * aStride;
+                    auto* pRi = pRes + i * resStride + c0;
+                    if (cN == W)
+                    {
+                        PackedMicro(pRi, resStride, pAi, aStride, pPanel, K);
+                    }
+                    else
+                    {
+                        // partial panel, go through the tile to not overflow
+                        PackedMicro(tile, W, pAi, aStride, pPanel, K);
+                        for (size_t r=0; r < MR; ++r)
+                            std::copy(tile + r * W, tile + r * W + cN, pRi + r * resStride);
+                    }
+                }
+            }
+
+            // leftover rows, one at a time over several panels per call
+            //  (a single panel is a single chain of dependent adds)
+            for (size_t i=mMicroEnd; i < mEnd; ++i)
+            {
+                for (size_t p=0; p < panelsN; p += TILE_PANELS_N)
+                {
+                    const auto pN = std::min(TILE_PANELS_N, panelsN - p);
+                    const auto c0 = p * W;
+                    const auto cN = std::min(pN * W, colsN - c0);
+                    PackedVecMulMat(tile, pA + i * aStride, pPanels + p * panelSize, K, pN);
+                    std::copy(tile, tile + cN, pRes + i * resStride + c0);
+                }
+            }
+
+            // the block is still hot, finish it
+            if (epilogue)
+                for (size_t i=m0; i < mEnd; ++i)
+                    epilogue(pRes + i * resStride, colsN);
+        }
+    }
+
+    // res (M x N) = A (M x K) * B (K x N), all row-major.
+    //  B is repacked on the fly in per-thread scratch memory
+    void MatMulMat(
+            float* pRes, const float* pA, const float* pB,
+            size_t M, size_t K, size_t N) const
+    {
+        auto* pPanels = getKernelScratch(calcPackedSize(K, N));
+        packPanels(pPanels, pB, nullptr, K, N);
+        PackedMatMulMat(pRes, N, pA, K, M, pPanels, K, N);
+    }
+
+private:
+    explicit TensorKernels(SIMDLevel lev)
+    {
+        switch (lev)
+        {
+#ifdef TA_SIMD_X86
+        case SIMDLevel::AVX512:
+            VecMulMat       = vecMulMat_AVX512;
+            PackedVecMulMat = packedVecMulMat_AVX512;
+            PackedMicro     = packedMicro_AVX512;
+            Sum             = sumSpan_AVX512<false>;
+            SumSq           = sumSpan_AVX512<true>;
+            Axpy            = axpy_AVX512;
+            BlendBits       = blendBits_AVX512;
+            PackedMicroMR   = 8;
+            break;
+        case SIMDLevel::AVX2:
+            VecMulMat       = vecMulMat_AVX2;
+            PackedVecMulMat = packedVecMulMat_AVX2;
+            PackedMicro     = packedMicro_AVX2;
+            Sum             = sumSpan_AVX2<false>;
+            SumSq           = sumSpan_AVX2<true>;
+            Axpy            = axpy_AVX2;
+            BlendBits       = blendBits_AVX2;
+            PackedMicroMR   = 4;
+            break;
+        case SIMDLevel::SSE42:
+            VecMulMat       = vecMulMat_SSE42;
+            PackedVecMulMat = packedVecMulMat_SSE42;
+            PackedMicro     = packedMicro_SSE42;
+            Sum             = sumSpan_SSE42<false>;
+            SumSq           = sumSpan_SSE42<true>;
+            Axpy            = axpy_SSE42;
+            BlendBits       = blendBits_SSE42;
+            PackedMicroMR   = 2;
+            break;
+#endif
+#ifdef TA_SIMD_NEON
+        case SIMDLevel::NEON:
+            VecMulMat       = vecMulMat_NEON;
+            PackedVecMulMat = packedVecMulMat_NEON;
+            PackedMicro     = packedMicro_NEON;
+            Sum             = sumSpan_NEON<false>;
+            SumSq           = sumSpan_NEON<true>;
+            Axpy            = axpy_NEON;
+            BlendBits       = blendBits_NEON;
+            PackedMicroMR   = 4;
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+};
+
+#endif
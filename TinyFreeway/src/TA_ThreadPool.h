@@ -0,0 +1,473 @@
+//==================================================================
+/// TA_ThreadPool.h
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#ifndef TA_THREADPOOL_H
+#define TA_THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <future>
+#include <exception>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <cstddef>
+#include <cassert>
+
+//==================================================================
+// Counts the tasks of a group that are still running, and keeps the
+//  first exception thrown by any of them.
+// Wait for it with ThreadPool::Wait(), which rethrows that exception.
+class WaitGroup
+{
+    friend class ThreadPool;
+
+    std::atomic<size_t>     mPendingN {};
+    std::mutex              mMutex;
+    std::condition_variable mCV;
+    std::exception_ptr      mpException;
+
+public:
+    bool IsDone() const { return mPendingN.load(std::memory_order_acquire) == 0; }
+
+private:
+    void add() { mPendingN.fetch_add(1, std::memory_order_relaxed); }
+
+    // all under the lock: the waiter may destroy the group as soon as it
+    //  can take the lock after the count reaches 0
+    void done(std::exception_ptr pEx)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (pEx && !mpException)
+            mpException = pEx;
+        if (mPendingN.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            mCV.notify_all();
+    }
+
+    void rethrowIfFailed()
+    {
+        std::exception_ptr pEx;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            std::swap(pEx, mpException);
+        }
+        if (pEx)
+            std::rethrow_exception(pEx);
+    }
+};
+
+//==================================================================
+// Long-lived worker threads, each with its own deque of tasks.
+// A worker runs its newest task first (still hot in cache) and, when it
+//  has nothing to do, steals the oldest task of another worker.
+// Tasks submitted from outside the pool are spread among the workers.
+// Waiting (Wait(), ParallelFor()) runs the pending tasks of the group
+//  instead of blocking, so it can also be done from inside a task. Only
+//  tasks of that group, so that nesting doesn't pile up on the stack.
+// Nested ParallelFor()s queue the inner tasks on the worker that runs the
+//  outer one, which runs them newest first. Idle workers steal them from
+//  the other end, so there's no guarantee on which worker runs what.
+// Once the queues have grown to the most tasks queued at a time, the
+//  tasks of Submit(wg, fn) and ParallelFor() don't allocate.
+class ThreadPool
+{
+    //==================================================================
+    // The function of a task. Stored in place when small enough (as for
+    //  ParallelFor() and Submit(wg, fn)), on the heap otherwise
+    class TaskFn
+    {
+        enum class Op { CALL, MOVE_TO, DESTROY };
+
+        static constexpr size_t INPLACE_SIZE = 48;
+
+        alignas(std::max_align_t) unsigned char mBuf[INPLACE_SIZE];
+        void (*mpOps)(Op, TaskFn&, TaskFn*) {};
+
+        template <typename F>
+        static constexpr bool IS_INPLACE =
+            sizeof(F) <= INPLACE_SIZE &&
+            alignof(F) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible_v<F>;
+
+        template <typename F>
+        static F* getFn(TaskFn& t)
+        {
+            if constexpr (IS_INPLACE<F>)
+                return std::launder((F*)t.mBuf);
+            else
+                return *std::launder((F**)t.mBuf);
+        }
+
+        template <typename F>
+        static void ops(Op op, TaskFn& self, TaskFn* pDst)
+        {
+            auto* pFn = getFn<F>(self);
+            switch (op)
+            {
+            case Op::CALL:
+                (*pFn)();
+                break;
+            case Op::MOVE_TO:
+                if constexpr (IS_INPLACE<F>)
+                {
+                    new (pDst->mBuf) F(std::move(*pFn));
+                    pFn->~F();
+                }
+                else
+                    new (pDst->mBuf) F*(pFn);
+                break;
+            case Op::DESTROY:
+                if constexpr (IS_INPLACE<F>)
+                    pFn->~F();
+                else
+                    delete pFn;
+                break;
+            }
+        }
+
+    public:
+        TaskFn() = default;
+
+        template <typename F,
+                  typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, TaskFn>>>
+        TaskFn(F&& fn)
+        {
+            using FD = std::decay_t<F>;
+            if constexpr (IS_INPLACE<FD>)
+                new (mBuf) FD(std::forward<F>(fn));
+            else
+                new (mBuf) FD*(new FD(std::forward<F>(fn)));
+            mpOps = &ops<FD>;
+        }
+
+        TaskFn(TaskFn&& other) noexcept { *this = std::move(other); }
+        TaskFn& operator=(TaskFn&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                if (other.mpOps)
+                {
+                    other.mpOps(Op::MOVE_TO, other, this);
+                    mpOps = std::exchange(other.mpOps, nullptr);
+                }
+            }
+            return *this;
+        }
+
+        ~TaskFn() { reset(); }
+
+        void operator()() { mpOps(Op::CALL, *this, nullptr); }
+
+        void reset()
+        {
+            if (mpOps)
+                std::exchange(mpOps, nullptr)(Op::DESTROY, *this, nullptr);
+        }
+    };
+
+    struct Task
+    {
+        TaskFn           fn;
+        const WaitGroup* pWG {};
+    };
+
+    //==================================================================
+    // The queue of a worker, a ring buffer that only grows
+    class TaskRing
+    {
+        std::vector<Task> mBuf; // power of 2 size
+        size_t            mHead {};
+        size_t            mN {};
+
+    public:
+        bool   empty() const { return mN == 0; }
+        size_t size()  const { return mN; }
+
+        // i-th from the front
+              Task& operator[](size_t i)       { return mBuf[(mHead + i) & (mBuf.size() - 1)]; }
+        const Task& operator[](size_t i) const { return mBuf[(mHead + i) & (mBuf.size() - 1)]; }
+
+        void push_back(Task&& task)
+        {
+            if (mN == mBuf.size())
+                grow();
+            (*this)[mN++] = std::move(task);
+        }
+
+        // remove the i-th, the ones after it move down
+        Task take(size_t i)
+        {
+            assert(i < mN);
+            auto task = std::move((*this)[i]);
+            if (i == 0)
+                mHead = (mHead + 1) & (mBuf.size() - 1);
+            else
+                for (size_t j=i; j+1 < mN; ++j)
+                    (*this)[j] = std::move((*this)[j+1]);
+            --mN;
+            return task;
+        }
+
+        void reserve(size_t n)
+        {
+            while (mBuf.size() < n)
+                grow();
+        }
+
+    private:
+        void grow()
+        {
+            std::vector<Task> buf(std::max<size_t>(16, mBuf.size() * 2));
+            for (size_t i=0; i < mN; ++i)
+                buf[i] = std::move((*this)[i]);
+            mBuf.swap(buf);
+            mHead = 0;
+        }
+    };
+
+    struct Worker
+    {
+        std::mutex       mMutex;
+        TaskRing         mTasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::vector<std::thread>             mThreads;
+
+    std::atomic<size_t>     mQueuedN {};
+    std::atomic<size_t>     mNextWorker {};
+    std::mutex              mSleepMutex;
+    std::condition_variable mSleepCV;
+    bool                    mStop {};
+
+    // the pool and worker index of the current thread, if it's a worker
+    static inline thread_local ThreadPool* stpCurPool {};
+    static inline thread_local size_t      stCurWorkerIdx {};
+
+public:
+    // threadsN = 0 means one per hardware thread
+    explicit ThreadPool(size_t threadsN = 0)
+    {
+        if (!threadsN)
+            threadsN = std::max<size_t>(1, std::thread::hardware_concurrency());
+
+        for (size_t i=0; i < threadsN; ++i)
+            mWorkers.push_back(std::make_unique<Worker>());
+
+        for (size_t i=0; i < threadsN; ++i)
+            mThreads.emplace_back([this, i](){ workerMain(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+            mStop = true;
+        }
+        mSleepCV.notify_all();
+        for (auto& t : mThreads)
+            t.join();
+    }
+
+    size_t GetThreadsN() const { return mThreads.size(); }
+
+    // room for tasksN queued tasks on each worker, so that queuing up to
+    //  that many doesn't allocate
+    void ReserveTasks(size_t tasksN)
+    {
+        for (auto& oW : mWorkers)
+        {
+            std::lock_guard<std::mutex> lock(oW->mMutex);
+            oW->mTasks.reserve(tasksN);
+        }
+    }
+
+    // run fn, the future gives back the result or the exception
+    template <typename F>
+    auto Submit(F&& fn) -> std::future<std::invoke_result_t<F>>
+    {
+        using R = std::invoke_result_t<F>;
+        auto pTask = std::make_shared<std::packaged_task<R ()>>(std::forward<F>(fn));
+        auto fut = pTask->get_future();
+        push({ [pTask](){ (*pTask)(); }, nullptr });
+        return fut;
+    }
+
+    // run fn as part of wg
+    template <typename F>
+    void Submit(WaitGroup& wg, F&& fn)
+    {
+        wg.add();
+        push({ [&wg, fn=std::forward<F>(fn)]() mutable
+        {
+            std::exception_ptr pEx;
+            try { fn(); }
+            catch (...) { pEx = std::current_exception(); }
+            wg.done(pEx);
+        }, &wg });
+    }
+
+    // wait for all the tasks of wg, running its pending tasks meanwhile.
+    //  Rethrows the first exception of the group, if any
+    void Wait(WaitGroup& wg)
+    {
+        while (!wg.IsDone())
+        {
+            if (runOne(&wg))
+                continue;
+
+            // none left in the queues, the remaining ones are running elsewhere
+            std::unique_lock<std::mutex> lock(wg.mMutex);
+            wg.mCV.wait_for(lock, std::chrono::milliseconds(1), [&](){ return wg.IsDone(); });
+        }
+        wg.rethrowIfFailed();
+    }
+
+    // run fn once on each worker (e.g. to set up its thread_local state).
+    //  A worker holds on to its task until all the workers have taken
+    //  theirs, so none can take two. Not from a worker, as it would wait
+    //  for itself
+    template <typename F>
+    void RunOnEachWorker(F&& fn)
+    {
+        assert(stpCurPool != this);
+        const auto n = mWorkers.size();
+        std::atomic<size_t> startedN {};
+        WaitGroup wg;
+        for (size_t i=0; i < n; ++i)
+        {
+            Submit(wg, [&fn, &startedN, n]()
+            {
+                startedN.fetch_add(1, std::memory_order_acq_rel);
+                while (startedN.load(std::memory_order_acquire) < n)
+                    std::this_thread::yield();
+                fn();
+            });
+        }
+        // no helping with the tasks here, that would leave a worker out
+        {
+            std::unique_lock<std::mutex> lock(wg.mMutex);
+            wg.mCV.wait(lock, [&](){ return wg.IsDone(); });
+        }
+        wg.rethrowIfFailed();
+    }
+
+    // fn(i) for i in [begin, end), in chunks of grainN indices.
+    //  The calling thread takes part, returns when all are done
+    template <typename F>
+    void ParallelFor(size_t begin, size_t end, size_t grainN, F&& fn)
+    {
+        grainN = std::max<size_t>(1, grainN);
+        WaitGroup wg;
+        for (size_t i=begin; i < end; i += grainN)
+        {
+            const auto iEnd = std::min(end, i + grainN);
+            Submit(wg, [&fn, i, iEnd]()
+            {
+                for (size_t j=i; j < iEnd; ++j)
+                    fn(j);
+            });
+        }
+        Wait(wg);
+    }
+
+private:
+    void push(Task&& task)
+    {
+        // a worker keeps its tasks, the others go round-robin
+        const auto wi = (stpCurPool == this)
+                            ? stCurWorkerIdx
+                            : mNextWorker.fetch_add(1, std::memory_order_relaxed) % mWorkers.size();
+        {
+            auto& w = *mWorkers[wi];
+            std::lock_guard<std::mutex> lock(w.mMutex);
+            w.mTasks.push_back(std::move(task));
+            mQueuedN.fetch_add(1, std::memory_order_release);
+        }
+        {
+            // pairs with the check under the lock in workerMain()
+            std::lock_guard<std::mutex> lock(mSleepMutex);
+        }
+        mSleepCV.notify_one();
+    }
+
+    // Own tasks from the back, other workers' from the front.
+    //  With pWG, only the tasks of that group, the newest first
+    bool tryPop(Task& out, const WaitGroup* pWG)
+    {
+        if (!mQueuedN.load(std::memory_order_acquire))
+            return false;
+
+        const auto n = mWorkers.size();
+        const bool isWorker = (stpCurPool == this);
+        const auto self = isWorker ? stCurWorkerIdx : 0;
+        for (size_t k=0; k < n; ++k)
+        {
+            auto& w = *mWorkers[(self + k) % n];
+            std::lock_guard<std::mutex> lock(w.mMutex);
+            const auto tasksN = w.mTasks.size();
+            if (!tasksN)
+                continue;
+
+            size_t idx = 0;
+            if (pWG)
+            {
+                idx = tasksN;
+                while (idx && w.mTasks[idx-1].pWG != pWG)
+                    --idx;
+                if (!idx)
+                    continue;
+                idx -= 1;
+            }
+            else
+            {
+                idx = (k == 0 && isWorker) ? tasksN-1 : 0;
+            }
+            out = w.mTasks.take(idx);
+            mQueuedN.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    bool runOne(const WaitGroup* pWG=nullptr)
+    {
+        Task task;
+        if (!tryPop(task, pWG))
+            return false;
+        task.fn();
+        return true;
+    }
+
+    void workerMain(size_t idx)
+    {
+        stpCurPool = this;
+        stCurWorkerIdx = idx;
+        for (;;)
+        {
+            if (runOne())
+                continue;
+
+            // on stop, leave only when all the queued tasks have been run
+            std::unique_lock<std::mutex> lock(mSleepMutex);
+            mSleepCV.wait(lock, [&](){ return mStop || mQueuedN.load() != 0; });
+            if (mStop && mQueuedN.load() == 0)
+                break;
+        }
+    }
+};
+
+#endif
@@ -14,9 +14,12 @@
 #include <functional>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cassert>
 #include "TA_SimpleNN.h"
 #include "TA_EvolutionEngine.h"
-#include "TA_QuickThreadPool.h"
+#include "TA_ThreadPool.h"
+#include "TA_AllocCounter.h"
 
 //==================================================================
 class TrainingManager
@@ -25,18 +28,52 @@ private:
     std::future<void>   mFuture;
     std::atomic<bool>   mShutdownReq {};
     size_t              mCurEpochN {};
+    // fitness evaluations (e.g. simulations) in the last epoch
+    std::atomic<size_t> mLastEvalsN {};
+    // heap allocations in the last epoch, see AllocCounter
+    std::atomic<size_t> mLastEpochAllocsN {};
     EvolutionEngine     mEvEngine;
+    // workers for the fitness evaluations, for the whole training
+    ThreadPool          mThPool;
 
 public:
     struct Params
     {
         std::vector<size_t> layerNs;
+        std::vector<ActivType> layerActs; // one per layer, empty for all GELU
+        EvolutionEngine::CrossOp crossOp {}; // how the parents are mixed
         size_t              maxEpochsN {};
-        std::function<double (const SimpleNN&, std::atomic<bool>&)> calcFitnessFn;
+        // samples (e.g. scenarios) per individual, the fitness is their average
+        size_t              samplesN {1};
+        // fitness of a network on one sample
+        std::function<double (const SimpleNN&, size_t, std::atomic<bool>&)> calcFitnessFn;
+        // optional, used instead of calcFitnessFn when set. Fitness of the flat
+        //  parameters on the samples [s0, s1) at once, into pFits[0..s1-s0)
+        //  (e.g. to run them in lockstep, with batched inference)
+        std::function<void (const Tensor&, size_t, size_t, double*, std::atomic<bool>&)> calcFitnessBatchFn;
+        // most samples per call of calcFitnessBatchFn. The samples of an
+        //  individual are split in tiles of about this size, a task each,
+        //  so that a slow individual doesn't hold up the epoch on one worker
+        size_t              batchTileN {8};
+        // optional, run once on each thread that evaluates the fitness,
+        //  before the first epoch (e.g. to create the per-thread state that
+        //  the fitness functions reuse, so that no epoch creates it)
+        std::function<void ()> initThreadFn;
+
+        // Racing: all are evaluated on the first samples, then only those
+        //  that can still make it to the top go on with more samples (twice
+        //  as many at each round). Needs the range of a sample's fitness,
+        //  to bound what the remaining samples can add: with the true range
+        //  the top is the same as with all the samples, a narrower one
+        //  drops more, at the risk of dropping a good one.
+        bool                useRacing {};
+        size_t              racingFirstSamplesN {2};
+        double              sampleFitnessMin {0};
+        double              sampleFitnessMax {1};
     };
 public:
     TrainingManager(const Params& par)
-        : mEvEngine(par.layerNs)
+        : mEvEngine(par.layerNs, par.layerActs, par.crossOp)
     {
         // Create the main thread that will continue until reached maxEpochsN
         //  or until requested to shutdown via the atomic flag in calcFitnessFn
@@ -52,7 +89,7 @@ public:
 
     void LockViewBestPool(
             const std::function<void(
-                const std::vector<Tensor>&,
+                const PopulationMatrix&,
                 const std::vector<ParamsInfo>&
                 )>& func)
     {
@@ -62,41 +99,101 @@ public:
 private:
     // Master execution thread that continuously runs the training
     //  one epoch at a time, with multiple threads to parallelize the
-    //  fitness calculations of the population
+    //  fitness calculations of the population.
+    // The fitness is reduced from the results of the samples, with
+    //  racing these are evaluated in rounds, see Params::useRacing
+    // Once the first epoch has sized all the buffers, the following ones
+    //  don't allocate (if the fitness functions don't), which is checked
+    //  when AllocCounter is enabled
     void ctor_execution(const Params& par)
     {
+        AllocCounter::Scope trackAllocs;
+
         // get the starting population (i.e. random or from file)
-        auto pool = mEvEngine.CreateInitialPopulation();
-        size_t popN = pool.size();
+        //  the populations are owned by mEvEngine, we get row views
+        const auto* pPool = &mEvEngine.CreateInitialPopulation(&mThPool);
+
+        // fitnesses are the results of the execution, per sample and reduced
+        const auto samplesN = std::max<size_t>(1, par.samplesN);
+        std::vector<double>     sampleFits;
+        std::vector<double>     fitnesses;
+        std::vector<ParamsInfo> infos;
+        // the individuals still being evaluated, and partial sums for racing
+        std::vector<size_t>     alive;
+        std::vector<double>     sums;
+        std::vector<double>     worstMeans;
+
+        const auto rankedN = mEvEngine.GetRankedN();
+
+        // sized for the largest generation
+        const auto maxPopN = mEvEngine.GetMaxPopulationN();
+        sampleFits.reserve(maxPopN * samplesN);
+        fitnesses.reserve(maxPopN);
+        infos.reserve(maxPopN);
+        alive.reserve(maxPopN);
+        sums.reserve(maxPopN);
+        worstMeans.reserve(maxPopN);
+        // an individual per task, and its tiles of samples when nested
+        mThPool.ReserveTasks(maxPopN + samplesN);
+
+        // the workers, and this thread, as it runs tasks while it waits
+        if (par.initThreadFn)
+        {
+            par.initThreadFn();
+            mThPool.RunOnEachWorker(par.initThreadFn);
+        }
 
         // For each epoch...
         for (size_t eidx=0; eidx < par.maxEpochsN && !mShutdownReq; ++eidx)
         {
             mCurEpochN = eidx;
+            const auto staAllocsN = AllocCounter::GetAllocsN();
+
+            const auto popN = pPool->size_rows();
+            sampleFits.assign(popN * samplesN, 0.0);
+            fitnesses.assign(popN, 0.0);
+            sums.assign(popN, 0.0);
+
+            alive.resize(popN);
+            for (size_t pidx=0; pidx < popN; ++pidx)
+                alive[pidx] = pidx;
 
-            // fitnesses are the results of the execution
-            std::vector<std::atomic<double>> fitnesses(popN);
+            size_t evalsN = 0;
+            size_t doneSamplesN = 0;
+            while (doneSamplesN < samplesN && !mShutdownReq)
             {
-                // create a thread for each available core
-                QuickThreadPool thpool( std::thread::hardware_concurrency() + 1 );
+                // the samples of this round
+                const auto s0 = doneSamplesN;
+                const auto s1 = par.useRacing
+                                    ? std::min(samplesN, std::max(par.racingFirstSamplesN, s0 * 2))
+                                    : samplesN;
+
+                evaluateSamples(par, *pPool, alive, s0, s1, sampleFits.data(), samplesN);
+                evalsN += alive.size() * (s1 - s0);
 
-                // for each member of the population...
-                for (size_t pidx=0; pidx < popN && !mShutdownReq; ++pidx)
+                // sums in sample order, to not depend on the scheduling
+                for (auto pidx : alive)
                 {
-                    thpool.AddThread([this, &params=pool[pidx], &fitness=fitnesses[pidx], &par]()
-                    {
-                        // create and evaluate the net with the given parameters
-                        fitness = par.calcFitnessFn(*mEvEngine.CreateNetwork(params), mShutdownReq);
-                    });
+                    const auto* pFits = sampleFits.data() + pidx * samplesN;
+                    for (size_t sidx=s0; sidx < s1; ++sidx)
+                        sums[pidx] += pFits[sidx];
                 }
+
+                doneSamplesN = s1;
+                if (doneSamplesN < samplesN)
+                    raceOut(par, alive, sums, worstMeans, fitnesses, doneSamplesN, samplesN, rankedN);
             }
+            mLastEvalsN = evalsN;
 
             // if we're shutting down, then exit before calling CreateNewEvolution()
             if (mShutdownReq)
                 break;
 
+            // reduce to the average. Those dropped already have an upper bound
+            for (auto pidx : alive)
+                fitnesses[pidx] = sums[pidx] / (double)samplesN;
+
             // generate the new population
-            std::vector<ParamsInfo> infos;
             infos.resize(popN);
             for (size_t pidx=0; pidx < popN; ++pidx)
             {
@@ -108,16 +205,117 @@ private:
 
             // Ask the EvolutionEngine to generate the new population based on the results
             // of the last one
-            pool = mEvEngine.CreateNewEvolution(eidx, pool.data(), infos.data(), popN);
+            pPool = &mEvEngine.CreateNewEvolution(eidx, *pPool, infos.data(), &mThPool);
 
-            popN = pool.size();
+            mLastEpochAllocsN = AllocCounter::GetAllocsN() - staAllocsN;
+            assert(!AllocCounter::sEnabled || eidx == 0 || mLastEpochAllocsN == 0);
         }
     }
+    // evaluate the samples [s0, s1) of the given individuals.
+    // There's a task per individual, spread round-robin on the workers,
+    //  and a nested task per tile of samples, queued on the worker that
+    //  runs the individual. Idle workers steal from any queue, so the tiles
+    //  of an individual may run on any worker.
+    // A tile is one sample with calcFitnessFn, up to batchTileN samples
+    //  with calcFitnessBatchFn.
+    void evaluateSamples(
+            const Params& par,
+            const PopulationMatrix& pool,
+            const std::vector<size_t>& pidxs,
+            size_t s0,
+            size_t s1,
+            double* pSampleFits,
+            size_t samplesN)
+    {
+        const auto tileN = par.calcFitnessBatchFn ? std::max<size_t>(1, par.batchTileN) : 1;
+        const auto tilesN = (s1 - s0 + tileN - 1) / tileN;
+
+        // for each member of the population...
+        mThPool.ParallelFor(0, pidxs.size(), 1, [&](size_t i)
+        {
+            AllocCounter::Scope trackAllocs;
+            if (mShutdownReq)
+                return;
+
+            const auto pidx = pidxs[i];
+            const auto params = pool.RowView(pidx);
+            auto* pFits = pSampleFits + pidx * samplesN;
+
+            // ...and for each tile of samples
+            mThPool.ParallelFor(0, tilesN, 1, [&](size_t ti)
+            {
+                AllocCounter::Scope trackTileAllocs;
+                if (mShutdownReq)
+                    return;
+
+                // same sizes, give or take one
+                const auto t0 = s0 + ti * (s1 - s0) / tilesN;
+                const auto t1 = s0 + (ti + 1) * (s1 - s0) / tilesN;
+                if (par.calcFitnessBatchFn)
+                {
+                    par.calcFitnessBatchFn(params, t0, t1, pFits + t0, mShutdownReq);
+                }
+                else
+                {
+                    // the net with the given parameters (a view, no copy)
+                    const auto net = mEvEngine.CreateNetworkView(params);
+                    for (size_t sidx=t0; sidx < t1; ++sidx)
+                        pFits[sidx] = par.calcFitnessFn(net, sidx, mShutdownReq);
+                }
+            });
+        });
+    }
+
+    // Racing: drop from alive the individuals that can't make it in the
+    //  top rankedN even if all their remaining samples go as well as they
+    //  can, compared to the worst that the rankedN-th can do.
+    //  The dropped get their best possible fitness, still below the top.
+    static void raceOut(
+            const Params& par,
+            std::vector<size_t>& alive,
+            const std::vector<double>& sums,
+            std::vector<double>& worstMeans,
+            std::vector<double>& fitnesses,
+            size_t doneSamplesN,
+            size_t samplesN,
+            size_t rankedN)
+    {
+        if (alive.size() <= rankedN)
+            return;
+
+        const auto leftN = (double)(samplesN - doneSamplesN);
+        auto bestMean  = [&](size_t pidx){ return (sums[pidx] + leftN * par.sampleFitnessMax) / (double)samplesN; };
+        auto worstMean = [&](size_t pidx){ return (sums[pidx] + leftN * par.sampleFitnessMin) / (double)samplesN; };
+
+        // the rankedN-th best of the worst cases is the cut
+        worstMeans.clear();
+        for (auto pidx : alive)
+            worstMeans.push_back(worstMean(pidx));
+
+        std::nth_element(worstMeans.begin(), worstMeans.begin() + (rankedN - 1), worstMeans.end(),
+                         std::greater<double>());
+        const auto cut = worstMeans[rankedN - 1];
+
+        size_t keptN = 0;
+        for (auto pidx : alive)
+        {
+            if (bestMean(pidx) < cut)
+                fitnesses[pidx] = bestMean(pidx);
+            else
+                alive[keptN++] = pidx;
+        }
+        alive.resize(keptN);
+    }
+
 public:
     auto& GetTrainerFuture() { return mFuture; }
 
     size_t GetCurEpochN() const { return mCurEpochN; }
 
+    size_t GetLastEvalsN() const { return mLastEvalsN; }
+
+    size_t GetLastEpochAllocsN() const { return mLastEpochAllocsN; }
+
     void ReqShutdown() { mShutdownReq = true; }
 };
 
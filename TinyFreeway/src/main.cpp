@@ -9,10 +9,12 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <array>
 #include <vector>
 #include <algorithm>
 #include <random>
+#include <filesystem>
 #include "IncludeGL.h"
 #include "DBase.h"
 #include "MathBase.h"
@@ -21,7 +23,13 @@
 #include "TA_SimpleNN.h"
 #include "TA_EvolutionEngine.h"
 #include "TA_TrainingManager.h"
+#include "TA_AllocCounter.h"
 #include "Simulation.h"
+#include "ScenarioBank.h"
+#include "SimBatch.h"
+
+// count the allocations for --check_allocs
+TA_ALLOC_COUNTER_DEFINE_NEW()
 
 // speed of our simulation, as well as display
 static constexpr auto FRAME_DT = 1.f / 60.f;
@@ -32,6 +40,31 @@ static constexpr auto TRAINING_SAMPLES_N = (size_t)20;
 // Testing set seed (anything above the training set)
 static constexpr auto TESTING_SEED = TRAINING_SAMPLES_N + 50;
 
+// Evaluate the training samples of a network in lockstep, see SimBatch.h
+static constexpr bool USE_BATCHED_SIMS = true;
+// Most samples run in lockstep by one task, the samples of a network are
+//  split in tiles of about this size, to balance the load on the threads
+static constexpr auto TRAINING_BATCH_TILE_N = (size_t)8;
+
+// Step of the training simulations. Larger steps train faster, the controls
+//  are then applied over sub-steps of about FRAME_DT, and hits are swept
+//  (above SIM_REF_DT), so that the nets still drive the same when played
+//  at FRAME_DT
+static constexpr auto TRAINING_SIM_DT = FRAME_DT;
+static constexpr auto TRAINING_CTRL_SUBSTEPS_N =
+                        std::max((size_t)(TRAINING_SIM_DT / FRAME_DT + 0.5f), (size_t)1);
+
+// Wall-clock limit of a training simulation, 0 for none. Off, because the
+//  results would depend on the machine and on the load (the simulations
+//  of a batch share the clock), the sim-time and stall limits already end
+//  the runs that go nowhere
+static constexpr auto TRAINING_SIM_MAX_WALL_TIME_S = 0.0;
+
+// Pre-built scenarios, loaded at start if the file is there.
+//  Make it with --make_scenario_bank
+static constexpr auto SCENARIO_BANK_FNAME = "scenario_bank.bin";
+static constexpr auto SCENARIO_BANK_SEEDS_N = (uint32_t)1000;
+
 //==================================================================
 static constexpr float DISP_CAM_NEAR    = 0.1f;     // near plane (meters)
 static constexpr float DISP_CAM_FAR     = 1000.f;   // far plane (meters)
@@ -59,17 +92,22 @@ public:
     double                          mLastEpochTimeS = 0;
     double                          mLastEpochLenTimeS = 0;
     // periodically updated from the training
-    std::vector<Tensor>          mBestPool;
+    PopulationMatrix             mBestPool;
     std::vector<ParamsInfo>      mBestPInfos;
 
     // simulation to play/test
     bool                            mPlayEnabled = true;
     uint32_t                        mPlaySeed = TESTING_SEED;
+    // the best nets, each driving one of our vehicles in the same traffic
+    int                             mPlayNetsN = 1;
     std::unique_ptr<Simulation>     moPlaySim;
-    std::unique_ptr<SimpleNN>       moPlayNet;
+    std::vector<SimpleNN>           mPlayNets;
 
     DemoMain()
     {
+        // use the pre-built scenarios, if any
+        loadScenarioBank();
+
         // start to train right away
         doStartTraining();
     }
@@ -86,6 +124,8 @@ private:
 
     void doStartTraining();
     void animateTrainer();
+
+    static void loadScenarioBank();
 } _demoMain;
 
 //==================================================================
@@ -153,27 +193,27 @@ inline void debugDraw(auto &immgl, const Vehicle& vh)
 }
 
 //==================================================================
-static void drawVehicle(ImmGL& immgl, const Vehicle& vh)
+static void drawVehicle(ImmGL& immgl, const Float3& pos, float speed, bool isNPC)
 {
-    const auto x0 = vh.mPos[0] - VH_WIDTH  * 0.5f;
-    const auto x1 = vh.mPos[0] + VH_WIDTH  * 0.5f;
-    const auto z0 = vh.mPos[2] - VH_LENGTH * 0.5f;
-    const auto z1 = vh.mPos[2] + VH_LENGTH * 0.5f;
+    const auto x0 = pos[0] - VH_WIDTH  * 0.5f;
+    const auto x1 = pos[0] + VH_WIDTH  * 0.5f;
+    const auto z0 = pos[2] - VH_LENGTH * 0.5f;
+    const auto z1 = pos[2] + VH_LENGTH * 0.5f;
 
     const std::array<IFloat3,4> vpos = {
-        IFloat3{x0, vh.mPos[1], z0},
-        IFloat3{x1, vh.mPos[1], z0},
-        IFloat3{x0, vh.mPos[1], z1},
-        IFloat3{x1, vh.mPos[1], z1},
+        IFloat3{x0, pos[1], z0},
+        IFloat3{x1, pos[1], z0},
+        IFloat3{x0, pos[1], z1},
+        IFloat3{x1, pos[1], z1},
     };
 
     static constexpr auto OWN_COL          = IColor4{1.0f,0.0f,0.0f,1.f};
     static constexpr auto NPC_COL          = IColor4{0.0f,0.0f,1.0f,1.f};
     static constexpr auto NPC_STRANDED_COL = IColor4{0.5f,0.0f,1.0f,1.f};
 
-    auto isStranded = vh.mSpeed < 0.001f;
+    auto isStranded = speed < 0.001f;
 
-    const auto baseCol = vh.mIsNPC
+    const auto baseCol = isNPC
         ? (isStranded ? NPC_STRANDED_COL : NPC_COL)
         : OWN_COL;
 
@@ -299,16 +339,137 @@ static void drawRoad(
 }
 
 //==================================================================
+static constexpr size_t calcHiddenN(size_t insN, size_t outsN, double coe)
+{
+    return std::max((size_t)((double)insN * coe), outsN);
+}
+
 static std::vector<size_t> makeLayerNs(size_t insN, size_t outsN)
 {
     return std::vector<size_t>{
         insN,
-        std::max((size_t)(insN * 1.25), outsN),
-        std::max((size_t)(insN * 0.75), outsN),
-        std::max((size_t)(insN * 0.25), outsN),
+        calcHiddenN(insN, outsN, 1.25),
+        calcHiddenN(insN, outsN, 0.75),
+        calcHiddenN(insN, outsN, 0.25),
         outsN};
 }
 
+//==================================================================
+// Fitness of a network on a training sample (in our cases it runs and
+//  evaluates a simulation). The TrainingManager averages the samples
+static uint32_t calcSampleSeed(size_t sidx)
+{
+    // We start with a random seed from a base that should not intersect with the validation set
+    // e.g. Don't want to train on seed 0, 1 and then validate on 0, 1
+    return (uint32_t)(sidx + TESTING_SEED);
+}
+
+static SimLimits makeTrainingSimLimits()
+{
+    // give up on runs that go nowhere, so they don't hold up the epoch
+    //  (the default sim-time and stall limits)
+    SimLimits lim;
+    lim.maxWallTimeS = TRAINING_SIM_MAX_WALL_TIME_S;
+    return lim;
+}
+
+static SimStepping makeTrainingSimStepping()
+{
+    SimStepping stepping;
+    stepping.ctrlSubstepsN = TRAINING_CTRL_SUBSTEPS_N;
+    // only needed for steps larger than the reference one
+    stepping.useSweptHits = TRAINING_SIM_DT > SIM_REF_DT;
+    return stepping;
+}
+
+// What a training thread keeps from one network to the next: the net is
+//  reloaded with the new parameters and the simulations are reset, so
+//  that the epochs after the first don't allocate
+struct TrainingWorkspace
+{
+    SimpleNN                    mNet;
+    std::unique_ptr<SimBatch>   moBatch;
+    std::unique_ptr<Simulation> moSim;
+    std::vector<uint32_t>       mSeeds;
+
+    TrainingWorkspace(const std::vector<size_t>& layerNs, const std::vector<ActivType>& layerActs)
+        : mNet(Tensor(1, SimpleNN::CalcNNSize(layerNs)), layerNs, layerActs)
+    {
+        // for the samples in lockstep, sized for a tile
+        const auto tileN = std::min(TRAINING_SAMPLES_N, TRAINING_BATCH_TILE_N);
+        moBatch = std::make_unique<SimBatch>(&mNet, makeTrainingSimLimits(), makeTrainingSimStepping());
+        for (size_t sidx=0; sidx < tileN; ++sidx)
+            mSeeds.push_back(calcSampleSeed(sidx));
+        moBatch->Reset(mSeeds.data(), mSeeds.size());
+        mNet.ReserveBatch(tileN);
+
+        // for one sample at a time, on the given net
+        moSim = std::make_unique<Simulation>(
+                        calcSampleSeed(0),
+                        &mNet,
+                        makeTrainingSimLimits(),
+                        makeTrainingSimStepping());
+    }
+};
+
+// The workspace of the current thread. The TrainingManager creates it on
+//  each of its threads before the first epoch (see Params::initThreadFn)
+static TrainingWorkspace& getTrainingWorkspace(
+        const std::vector<size_t>& layerNs,
+        const std::vector<ActivType>& layerActs)
+{
+    thread_local std::unique_ptr<TrainingWorkspace> toWS;
+    if (!toWS)
+        toWS = std::make_unique<TrainingWorkspace>(layerNs, layerActs);
+    return *toWS;
+}
+
+static double calcNetSampleFitness(
+        const SimpleNN& net,
+        const std::vector<size_t>& layerNs,
+        const std::vector<ActivType>& layerActs,
+        size_t sidx,
+        std::atomic<bool>& reqShutdown)
+{
+    // a simulation per thread, reset for each scenario and neural net
+    auto& sim = *getTrainingWorkspace(layerNs, layerActs).moSim;
+    sim.SetNNet(&net);
+    sim.Reset(calcSampleSeed(sidx));
+
+    // run to completion (includes timeout)
+    while (sim.IsSimRunning() && !reqShutdown)
+        sim.AnimateSim(TRAINING_SIM_DT);
+
+    return sim.GetSimScore();
+}
+
+// Same as calcNetSampleFitness() for the parameters of a net, on the
+//  samples [s0, s1), all run in lockstep with the net applied to all of
+//  them at once
+static void calcParamsSamplesFitness(
+        const Tensor& params,
+        const std::vector<size_t>& layerNs,
+        const std::vector<ActivType>& layerActs,
+        size_t s0,
+        size_t s1,
+        double* pFits,
+        std::atomic<bool>& reqShutdown)
+{
+    auto& ws = getTrainingWorkspace(layerNs, layerActs);
+    ws.mNet.LoadParams(params);
+
+    ws.mSeeds.clear();
+    for (size_t sidx=s0; sidx < s1; ++sidx)
+        ws.mSeeds.push_back(calcSampleSeed(sidx));
+
+    auto& batch = *ws.moBatch;
+    batch.Reset(ws.mSeeds.data(), ws.mSeeds.size());
+    batch.RunToEnd(TRAINING_SIM_DT, reqShutdown);
+
+    for (size_t i=0; i < batch.GetSimsN(); ++i)
+        pFits[i] = batch.GetSim(i).GetSimScore();
+}
+
 //==================================================================
 void DemoMain::AnimateDemo(float dt)
 {
@@ -317,13 +478,23 @@ void DemoMain::AnimateDemo(float dt)
     {
         if (!mBestPool.empty())
         {
-            moPlayNet = std::make_unique<SimpleNN>(
-                mBestPool[0],
-                makeLayerNs(Vehicle::SENS_N, Vehicle::CTRL_N));
-
+            const auto netsN = std::min((size_t)mPlayNetsN, mBestPool.size_rows());
+            mPlayNets.clear();
+            for (size_t i=0; i < netsN; ++i)
+                mPlayNets.emplace_back(
+                    mBestPool.RowView(i),
+                    makeLayerNs(Vehicle::SENS_N, Vehicle::CTRL_N));
+
+            std::vector<const SimpleNN*> pNets;
+            for (const auto& net : mPlayNets)
+                pNets.push_back(&net);
+
+            // played until it ends on its own, as long as it takes
             moPlaySim = std::make_unique<Simulation>(
                 mPlaySeed,
-                moPlayNet.get());
+                pNets.data(),
+                pNets.size(),
+                SimLimits::CreateUnlimited());
         }
     }
     if (moPlaySim)
@@ -346,6 +517,11 @@ void DemoMain::animateTrainer()
         mLastEpochLenTimeS = curTimeS - mLastEpochTimeS;
         mLastEpoch = curEpoch;
         mLastEpochTimeS = curTimeS;
+
+        // with --check_allocs, the epochs after the first must not allocate
+        if (AllocCounter::sEnabled && curEpoch >= 2 && moTrainer->GetLastEpochAllocsN())
+            printf("Epoch %zu made %zu heap allocations\n",
+                    curEpoch - 1, moTrainer->GetLastEpochAllocsN());
     }
 
     auto& fut = moTrainer->GetTrainerFuture();
@@ -375,12 +551,21 @@ void DemoMain::DrawDemo(ImmGL& immgl)
     if (moPlaySim)
     {
         // draw the vehicles
-        for (auto& vh : moPlaySim->GetVehicles())
-            drawVehicle(immgl, vh);
+        const auto& ourVh = moPlaySim->GetOurVehicle();
+        const auto& npcs = moPlaySim->GetNPCs();
+        for (size_t i=0; i < npcs.size(); ++i)
+            drawVehicle(immgl, npcs.GetPos(i), npcs.mSpeed[i], true);
+
+        // ours, the best last (on top)
+        for (size_t ei=moPlaySim->GetEgosN(); ei-- > 0;)
+        {
+            const auto& vh = moPlaySim->GetOurVehicle(ei);
+            drawVehicle(immgl, vh.mPos, vh.mSpeed, false);
+        }
 
         // draw the debug stuff
         if (_demoMain.mShowDebugDraw)
-            debugDraw(immgl, moPlaySim->GetVehicles()[0]);
+            debugDraw(immgl, ourVh);
     }
 }
 
@@ -388,11 +573,27 @@ void DemoMain::DrawDemo(ImmGL& immgl)
 Float3 DemoMain::GetOurVehiclePos() const
 {
     if (moPlaySim)
-        return moPlaySim->GetVehicles()[0].mPos;
+        return moPlaySim->GetOurVehicle().mPos;
 
     return Float3{0.f,0.f,0.f};
 }
 
+//==================================================================
+void DemoMain::loadScenarioBank()
+{
+    if (!std::filesystem::exists(SCENARIO_BANK_FNAME))
+        return;
+
+    try {
+        const auto pBank = ScenarioBank::Load(SCENARIO_BANK_FNAME);
+        printf("Loaded %u scenarios from %s\n", pBank->GetSeedsN(), SCENARIO_BANK_FNAME);
+    }
+    catch (const std::exception& ex)
+    {
+        printf("%s\n", ex.what());
+    }
+}
+
 //==================================================================
 void DemoMain::doStartTraining()
 {
@@ -404,28 +605,38 @@ void DemoMain::doStartTraining()
     // Maximum number of epochs for the training
     par.maxEpochsN = 10000;
 
-    // Fitness calculation function (in our cases it runs and evaluates a simulation)
-    par.calcFitnessFn = [](const auto &net, std::atomic<bool>& reqShutdown)
-    {
-        double totFitness = 0;
-        // run a simulation for each variant
-        for (size_t sidx=0; sidx < TRAINING_SAMPLES_N; ++sidx)
-        {
-            // We start with a random seed from a base that should not intersect with the validation set
-            // e.g. Don't want to train on seed 0, 1 and then validate on 0, 1
-            const auto seed = (uint32_t)(sidx + TESTING_SEED);
+    // A simulation for each variant
+    par.samplesN = TRAINING_SAMPLES_N;
 
-            // create a simulation for the given scenario and neural net
-            auto oSim = std::make_unique<Simulation>(seed, &net);
+    // Stop simulating those that can't make it to the top anyway
+    par.useRacing = true;
+    par.sampleFitnessMin = 0;
+    par.sampleFitnessMax = Simulation::GetSimScoreMax();
 
-            // run to completion (includes timeout)
-            while (oSim->IsSimRunning() && !reqShutdown)
-                oSim->AnimateSim(FRAME_DT);
+    // Fitness calculation function (in our cases it runs and evaluates a simulation)
+    par.calcFitnessFn = [layerNs=par.layerNs, layerActs=par.layerActs](
+            const SimpleNN& net, size_t sidx, std::atomic<bool>& reqShutdown)
+    {
+        return calcNetSampleFitness(net, layerNs, layerActs, sidx, reqShutdown);
+    };
 
-            totFitness += oSim->GetSimScore();
-        }
+    // Run the samples of a network together, with batched inference
+    //  (the net is built with packed weights, same results as one at a time),
+    //  in tiles of samples, each a task
+    if (USE_BATCHED_SIMS)
+    {
+        par.calcFitnessBatchFn = [layerNs=par.layerNs, layerActs=par.layerActs](
+                const Tensor& params, size_t s0, size_t s1, double* pFits, std::atomic<bool>& reqShutdown)
+        {
+            calcParamsSamplesFitness(params, layerNs, layerActs, s0, s1, pFits, reqShutdown);
+        };
+        par.batchTileN = TRAINING_BATCH_TILE_N;
+    }
 
-        return totFitness / TRAINING_SAMPLES_N;
+    // the simulations and nets of each training thread, made up front
+    par.initThreadFn = [layerNs=par.layerNs, layerActs=par.layerActs]()
+    {
+        getTrainingWorkspace(layerNs, layerActs);
     };
 
     // Do create the trainer
@@ -476,11 +687,15 @@ void DemoMain::handleTrainUI()
         {
             ImGui::Text("Epoch time: %.1fs", mLastEpochLenTimeS);
             ImGui::Text("Epochs per hour: %.1f", 60*60 / mLastEpochLenTimeS);
+            ImGui::Text("Simulations per epoch: %zu", moTrainer->GetLastEvalsN());
+            if (AllocCounter::sEnabled)
+                ImGui::Text("Allocations per epoch: %zu", moTrainer->GetLastEpochAllocsN());
         }
         else
         {
             ImGui::Text("Epoch time: -");
             ImGui::Text("Epochs per hour: -");
+            ImGui::Text("Simulations per epoch: -");
         }
     }
 
@@ -535,6 +750,8 @@ void DemoMain::handlePlayUI()
     ImGui::SameLine();
     ImGui::SetNextItemWidth(100);
     ImGui::InputScalar("Seed", ImGuiDataType_U32, &mPlaySeed);
+    ImGui::SetNextItemWidth(100);
+    ImGui::SliderInt("Nets", &mPlayNetsN, 1, 10);
 
     if (moPlaySim)
     {
@@ -560,12 +777,23 @@ void DemoMain::handlePlayUI()
             ImGui::Text("%s", buf);
         };
 
-        // simulation parameters
+        // simulation parameters, of the best net
+        if (moPlaySim->GetEgosN() > 1)
+        {
+            size_t runningN = 0;
+            for (size_t ei=0; ei < moPlaySim->GetEgosN(); ++ei)
+                runningN += moPlaySim->IsEgoRunning(ei) ? 1 : 0;
+            nameAndValue("Running", "%zu / %zu", runningN, moPlaySim->GetEgosN());
+        }
         nameAndValue("Run Time", "%.1f s", moPlaySim->GetRunTimeS());
         nameAndValue("Score", "%.1f", moPlaySim->GetSimScore());
         nameAndValue("Hit Vehicle", "%s", moPlaySim->HasHitVehicle() ? "yes" : "no");
         nameAndValue("Hit Curb", "%s", moPlaySim->HasHitCurb() ? "yes" : "no");
         nameAndValue("Arrived", "%s", moPlaySim->HasArrived() ? "yes" : "no");
+        nameAndValue("End", "%s", SimEndReasonToStr(moPlaySim->GetEndReason()));
+        if (ProbeCheck::sEnabled)
+            nameAndValue("Probe Mismatches", "%zu / %zu",
+                    ProbeCheck::sMismatchesN.load(), ProbeCheck::sChecksN.load());
 
         ImGui::EndTable();
     }
@@ -594,6 +822,32 @@ void DemoMain::HandleUI(size_t frameCnt)
 //==================================================================
 int main( int argc, char *argv[] )
 {
+    for (int i=1; i < argc; ++i)
+    {
+        // save the scenarios, and quit
+        if (!strcmp(argv[i], "--make_scenario_bank"))
+        {
+            try {
+                ScenarioBank::Write(SCENARIO_BANK_FNAME, 0, SCENARIO_BANK_SEEDS_N);
+            }
+            catch (const std::exception& ex)
+            {
+                printf("%s\n", ex.what());
+                return 1;
+            }
+            printf("Saved %u scenarios to %s\n", SCENARIO_BANK_SEEDS_N, SCENARIO_BANK_FNAME);
+            return 0;
+        }
+
+        // check the probe sensors against the reference version
+        if (!strcmp(argv[i], "--probe_check"))
+            ProbeCheck::sEnabled = true;
+
+        // count the heap allocations of the training epochs
+        if (!strcmp(argv[i], "--check_allocs"))
+            AllocCounter::sEnabled = true;
+    }
+
     MinimalSDLApp app( argc, argv, 1200, 750, 0
                     | MinimalSDLApp::FLAG_OPENGL
                     | MinimalSDLApp::FLAG_RESIZABLE
@@ -0,0 +1,123 @@
+//==================================================================
+/// test_activations.cpp
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <functional>
+#include "TA_Activations.h"
+
+// The float span kernels of each instruction set vs the double version,
+//  which uses libm (std::erf, std::tanh, std::exp) as the reference.
+
+//==================================================================
+static const char* activName(ActivType at)
+{
+    switch (at)
+    {
+    case ActivType::GELU:       return "GELU";
+    case ActivType::GELU_TANH:  return "GELU_TANH";
+    case ActivType::RELU:       return "RELU";
+    case ActivType::LEAKY_RELU: return "LEAKY_RELU";
+    case ActivType::TANH:       return "TANH";
+    case ActivType::SIGMOID:    return "SIGMOID";
+    default:                    return "?";
+    }
+}
+
+// max abs. error allowed over [-10, 10]
+static double maxAllowedErr(ActivType at)
+{
+    switch (at)
+    {
+    case ActivType::GELU:      return 2e-6;
+    case ActivType::GELU_TANH: return 2e-6; // vs its own formula, in double
+    default:                   return 1e-6;
+    }
+}
+
+//==================================================================
+using SpanFn = std::function<void (ActivType, float*, size_t)>;
+
+static int checkSpanFn(const char* pName, const SpanFn& spanFn)
+{
+    constexpr size_t N = 200001;
+    std::vector<float> xs(N);
+    for (size_t i=0; i < N; ++i)
+        xs[i] = -10.f + 20.f * (float)i / (float)(N - 1);
+
+    int failsN = 0;
+    for (size_t ai=0; ai < (size_t)ActivType::N; ++ai)
+    {
+        const auto at = (ActivType)ai;
+        auto ys = xs;
+        spanFn(at, ys.data(), N);
+
+        double maxErr = 0;
+        double maxErrX = 0;
+        VisitActivType(at, [&](auto a)
+        {
+            for (size_t i=0; i < N; ++i)
+            {
+                const auto ref = Activate<decltype(a)::value>((double)xs[i]);
+                auto err = std::abs((double)ys[i] - ref);
+                if (std::isnan(err))
+                    err = INFINITY;
+                if (err > maxErr)
+                {
+                    maxErr = err;
+                    maxErrX = xs[i];
+                }
+            }
+        });
+
+        const auto ok = maxErr <= maxAllowedErr(at);
+        printf("%-8s %-10s max err %.3g at x=%g %s\n",
+                pName, activName(at), maxErr, maxErrX, ok ? "OK" : "FAIL");
+        failsN += ok ? 0 : 1;
+    }
+    return failsN;
+}
+
+//==================================================================
+int main()
+{
+    int failsN = 0;
+
+    failsN += checkSpanFn("generic", [](ActivType at, float* p, size_t n)
+    {
+        VisitActivType(at, [&](auto a){ ActivateSpan<decltype(a)::value>(p, n); });
+    });
+
+#ifdef TA_SIMD_X86
+    const auto lev = detectSIMDLevel();
+    if (lev >= SIMDLevel::SSE42)
+        failsN += checkSpanFn("SSE4.2", [](ActivType at, float* p, size_t n)
+        {
+            VisitActivType(at, [&](auto a){ activSpan_SSE42<decltype(a)::value>(p, n); });
+        });
+    if (lev >= SIMDLevel::AVX2)
+        failsN += checkSpanFn("AVX2", [](ActivType at, float* p, size_t n)
+        {
+            VisitActivType(at, [&](auto a){ activSpan_AVX2<decltype(a)::value>(p, n); });
+        });
+    if (lev >= SIMDLevel::AVX512)
+        failsN += checkSpanFn("AVX-512", [](ActivType at, float* p, size_t n)
+        {
+            VisitActivType(at, [&](auto a){ activSpan_AVX512<decltype(a)::value>(p, n); });
+        });
+#endif
+
+    // the run-time selected table
+    failsN += checkSpanFn("selected", [](ActivType at, float* p, size_t n)
+    {
+        ActivateSpanRT(at, p, n);
+    });
+
+    printf("%s\n", failsN ? "FAILED" : "PASSED");
+    return failsN ? 1 : 0;
+}
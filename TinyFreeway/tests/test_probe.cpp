@@ -0,0 +1,128 @@
+//==================================================================
+/// test_probe.cpp
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <cstdio>
+#include <random>
+#include "Simulation.h"
+
+// calcProbeIdx() vs calcProbeIdxRef(): they must agree outside of the
+//  band around the edges (where the simulation uses the reference), and
+//  the band must be rare.
+
+//==================================================================
+static constexpr size_t RANDOM_N = 4000000;
+static constexpr size_t LANE_N   = 2000000;
+static constexpr size_t EDGE_N   = 200000;
+
+static constexpr double MAX_ALLOWED_NEAR_RATE = 1e-3;
+
+struct Counts
+{
+    size_t  checksN {};
+    size_t  nearN {};
+    size_t  mismatchesN {};
+};
+
+static void checkTarget(Counts& cnt, const Float3& pos, const Float3& otherPos)
+{
+    const auto dx = otherPos[0] - pos[0];
+    const auto dz = otherPos[2] - pos[2];
+    if (dx == 0 && dz == 0)
+        return;
+
+    cnt.checksN += 1;
+    if (isNearProbeEdge(dx, dz))
+    {
+        cnt.nearN += 1;
+        return;
+    }
+
+    const auto ref = calcProbeIdxRef(pos, otherPos);
+    const auto idx = calcProbeIdx(dx, dz);
+    if (ref != idx)
+    {
+        if (cnt.mismatchesN < 5)
+            printf("  mismatch at dx=%.9g dz=%.9g ref=%zu idx=%u\n", dx, dz, ref, idx);
+        cnt.mismatchesN += 1;
+    }
+}
+
+static int report(const char* pName, const Counts& cnt, bool checkNearRate)
+{
+    const auto nearRate = (double)cnt.nearN / (double)cnt.checksN;
+    const auto ok = cnt.mismatchesN == 0 &&
+                    (!checkNearRate || nearRate <= MAX_ALLOWED_NEAR_RATE);
+    printf("%-8s checks %zu near edge %zu (%.2g) mismatches %zu %s\n",
+            pName, cnt.checksN, cnt.nearN, nearRate, cnt.mismatchesN, ok ? "OK" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+//==================================================================
+int main()
+{
+    int failsN = 0;
+
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> distOff(-VH_PROBE_RADIUS, VH_PROBE_RADIUS);
+    std::uniform_real_distribution<float> distX(-SLAB_WIDTH * 0.5f, SLAB_WIDTH * 0.5f);
+    std::uniform_real_distribution<float> distZ(-TRACK_LEN_M, 0.f);
+
+    // anywhere around us
+    {
+        Counts cnt;
+        for (size_t i=0; i < RANDOM_N; ++i)
+        {
+            const auto pos = Float3(distX(gen), VH_ELEVATION, distZ(gen));
+            checkTarget(cnt, pos, Float3(pos[0] + distOff(gen), VH_ELEVATION, pos[2] + distOff(gen)));
+        }
+        failsN += report("random", cnt, true);
+    }
+
+    // NPCs at the center of the lanes or at the edges of the road, as
+    //  they spawn, from us at the center of a lane or anywhere
+    {
+        const auto laneW = SLAB_WIDTH / ROAD_LANES_N;
+        std::uniform_int_distribution<int> distLane(0, ROAD_LANES_N + 1);
+        auto laneX = [&](int lane)
+        {
+            if (lane == ROAD_LANES_N)
+                return -SLAB_WIDTH * 0.5f;
+            if (lane == ROAD_LANES_N + 1)
+                return SLAB_WIDTH * 0.5f;
+            return (float)lane * laneW - SLAB_WIDTH * 0.5f + laneW * 0.5f;
+        };
+
+        Counts cnt;
+        for (size_t i=0; i < LANE_N; ++i)
+        {
+            const auto x = (i & 1) ? distX(gen) : laneX(distLane(gen) % ROAD_LANES_N);
+            const auto pos = Float3(x, VH_ELEVATION, distZ(gen));
+            checkTarget(cnt, pos, Float3(laneX(distLane(gen)), VH_ELEVATION, pos[2] + distOff(gen)));
+        }
+        failsN += report("lanes", cnt, true);
+    }
+
+    // right around the edges, where the two are most likely to disagree
+    {
+        std::uniform_int_distribution<int> distEdge(0, 2 * Vehicle::PROBES_N - 1);
+        std::uniform_real_distribution<double> distAng(-1e-4, 1e-4);
+        std::uniform_real_distribution<float> distR(1.f, VH_PROBE_RADIUS);
+
+        Counts cnt;
+        for (size_t i=0; i < EDGE_N; ++i)
+        {
+            const auto pos = Float3(distX(gen), VH_ELEVATION, distZ(gen));
+            const auto ang = glm::pi<double>() / Vehicle::PROBES_N * distEdge(gen) + distAng(gen);
+            const auto r = distR(gen);
+            checkTarget(cnt, pos, Float3(pos[0] + r * (float)cos(ang), VH_ELEVATION, pos[2] + r * (float)sin(ang)));
+        }
+        failsN += report("edges", cnt, false);
+    }
+
+    printf("%s\n", failsN ? "FAILED" : "PASSED");
+    return failsN ? 1 : 0;
+}
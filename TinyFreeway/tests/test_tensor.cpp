@@ -0,0 +1,166 @@
+//==================================================================
+/// test_tensor.cpp
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <functional>
+#include "TA_Tensor.h"
+
+// The element-wise API of TensorT, and the float kernels behind axpy and
+//  the sums of each instruction set vs the same in double.
+
+//==================================================================
+// sizes around the vector widths, for the tails
+static const size_t SIZES[] = { 1, 3, 4, 7, 8, 15, 16, 17, 33, 100, 1000, 22851 };
+
+static constexpr double MAX_ALLOWED_REL_ERR = 1e-5;
+
+using SumFn  = std::function<float (const float*, size_t)>;
+using AxpyFn = std::function<void (float*, float, const float*, size_t)>;
+
+// relative to the magnitude of what's summed, a NaN counts as the largest
+static double calcRelErr(double val, double ref, double mag)
+{
+    const auto err = std::abs(val - ref) / std::max(mag, 1.0);
+    return std::isnan(err) ? INFINITY : err;
+}
+
+static int checkKernels(const char* pName, const SumFn& sumFn, const SumFn& sumSqFn, const AxpyFn& axpyFn)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.f, 1.f);
+
+    double maxSumErr = 0;
+    double maxSumSqErr = 0;
+    double maxAxpyErr = 0;
+    for (const auto n : SIZES)
+    {
+        std::vector<float> xs(n);
+        std::vector<float> ys(n);
+        for (size_t i=0; i < n; ++i)
+        {
+            xs[i] = dist(rng);
+            ys[i] = dist(rng);
+        }
+
+        double refSum = 0;
+        double refSumSq = 0;
+        double mag = 0;
+        for (const auto x : xs)
+        {
+            refSum += x;
+            refSumSq += (double)x * x;
+            mag += std::abs(x);
+        }
+        maxSumErr = std::max(maxSumErr, calcRelErr(sumFn(xs.data(), n), refSum, mag));
+        maxSumSqErr = std::max(maxSumSqErr, calcRelErr(sumSqFn(xs.data(), n), refSumSq, refSumSq));
+
+        const auto a = dist(rng);
+        auto res = ys;
+        axpyFn(res.data(), a, xs.data(), n);
+        for (size_t i=0; i < n; ++i)
+        {
+            const auto ref = (double)ys[i] + (double)a * xs[i];
+            maxAxpyErr = std::max(maxAxpyErr, calcRelErr(res[i], ref, 1.0));
+        }
+    }
+
+    int failsN = 0;
+    auto report = [&](const char* pOp, double err)
+    {
+        const auto ok = err <= MAX_ALLOWED_REL_ERR;
+        printf("%-8s %-7s max rel err %.3g %s\n", pName, pOp, err, ok ? "OK" : "FAIL");
+        failsN += ok ? 0 : 1;
+    };
+    report("Sum", maxSumErr);
+    report("SumSq", maxSumSqErr);
+    report("Axpy", maxAxpyErr);
+    return failsN;
+}
+
+//==================================================================
+static int checkElementWise()
+{
+    int failsN = 0;
+    auto check = [&](const char* pOp, bool ok)
+    {
+        printf("TensorT  %-7s %s\n", pOp, ok ? "OK" : "FAIL");
+        failsN += ok ? 0 : 1;
+    };
+
+    Tensor a(3, 5);
+    Tensor b(3, 5);
+    for (size_t i=0; i < a.size(); ++i)
+    {
+        a.data()[i] = (float)i;
+        b.data()[i] = (float)(2 * i);
+    }
+
+    Tensor t = a;
+    t.Map([](float x){ return x * 3.f; });
+    bool ok = true;
+    for (size_t i=0; i < t.size(); ++i)
+        ok = ok && t.data()[i] == 3.f * i;
+    check("Map", ok);
+
+    t.ZipMap(a, b, [](float x, float y){ return x - y; });
+    ok = true;
+    for (size_t i=0; i < t.size(); ++i)
+        ok = ok && t.data()[i] == -(float)i;
+    check("ZipMap", ok);
+
+    t.Axpy(2.f, a);
+    ok = true;
+    for (size_t i=0; i < t.size(); ++i)
+        ok = ok && t.data()[i] == (float)i;
+    check("Axpy", ok);
+
+    size_t visitsN = 0;
+    t.ForEach([&](float& x){ x += 1.f; ++visitsN; });
+    check("ForEach", visitsN == t.size() && t(2, 4) == 15.f);
+
+    TensorT<double> d(2, 3);
+    d.Map([](double){ return 0.5; });
+    check("Sum", a.Sum() == 105.f && d.Sum() == 3.0 && d.SumSq() == 1.5);
+
+    return failsN;
+}
+
+//==================================================================
+int main()
+{
+    int failsN = checkElementWise();
+
+    failsN += checkKernels("scalar",
+                    sumSpan_Scalar<false>, sumSpan_Scalar<true>, axpy_Scalar);
+
+#ifdef TA_SIMD_X86
+    const auto lev = detectSIMDLevel();
+    if (lev >= SIMDLevel::SSE42)
+        failsN += checkKernels("SSE4.2",
+                    sumSpan_SSE42<false>, sumSpan_SSE42<true>, axpy_SSE42);
+    if (lev >= SIMDLevel::AVX2)
+        failsN += checkKernels("AVX2",
+                    sumSpan_AVX2<false>, sumSpan_AVX2<true>, axpy_AVX2);
+    if (lev >= SIMDLevel::AVX512)
+        failsN += checkKernels("AVX-512",
+                    sumSpan_AVX512<false>, sumSpan_AVX512<true>, axpy_AVX512);
+#endif
+#ifdef TA_SIMD_NEON
+    failsN += checkKernels("NEON",
+                    sumSpan_NEON<false>, sumSpan_NEON<true>, axpy_NEON);
+#endif
+
+    // the run-time selected table
+    const auto& kern = TensorKernels::Get();
+    failsN += checkKernels("selected", kern.Sum, kern.SumSq, kern.Axpy);
+
+    printf("%s\n", failsN ? "FAILED" : "PASSED");
+    return failsN ? 1 : 0;
+}
@@ -0,0 +1,139 @@
+//==================================================================
+/// test_training_allocs.cpp
+///
+/// See the file "license.txt" that comes with this project for
+/// copyright info.
+//==================================================================
+
+#include <cstdio>
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include "TA_AllocCounter.h"
+#include "TA_TrainingManager.h"
+
+TA_ALLOC_COUNTER_DEFINE_NEW()
+
+// The training epochs after the first must not allocate, with either
+//  fitness function, when these don't allocate themselves. The fitness
+//  functions here are trivial: a forward pass on fixed inputs, with the
+//  per-thread state created by Params::initThreadFn, as main.cpp does.
+
+//==================================================================
+static const std::vector<size_t> LAYER_NS {16, 24, 12, 4};
+
+static constexpr size_t SAMPLES_N = 20;
+static constexpr size_t BATCH_TILE_N = 8;
+
+// what a thread keeps from one call to the next
+struct ThreadState
+{
+    SimpleNN    mNet;
+    Tensor      mIns;
+    Tensor      mOuts;
+
+    ThreadState()
+        : mNet(Tensor(1, SimpleNN::CalcNNSize(LAYER_NS)), LAYER_NS)
+        , mIns(BATCH_TILE_N, LAYER_NS.front())
+        , mOuts(BATCH_TILE_N, LAYER_NS.back())
+    {
+        mNet.ReserveBatch(BATCH_TILE_N);
+    }
+};
+
+static ThreadState& getThreadState()
+{
+    thread_local std::unique_ptr<ThreadState> toState;
+    if (!toState)
+        toState = std::make_unique<ThreadState>();
+    return *toState;
+}
+
+// the inputs of a sample
+static void fillSampleIns(float* pIns, size_t sidx)
+{
+    for (size_t i=0; i < LAYER_NS.front(); ++i)
+        pIns[i] = std::sin((float)(sidx * 7 + i));
+}
+
+// in [0, 1], from the outputs
+static double calcOutsFitness(const float* pOuts)
+{
+    return std::clamp(0.5 + 0.1 * (double)pOuts[0], 0.0, 1.0);
+}
+
+static double calcNetSampleFitness(const SimpleNN& net, size_t sidx)
+{
+    auto& st = getThreadState();
+    auto ins  = Tensor(1, LAYER_NS.front(), st.mIns[0], false);
+    auto outs = Tensor(1, LAYER_NS.back(), st.mOuts[0], false);
+    fillSampleIns(ins.data(), sidx);
+    net.ForwardPass(outs, ins);
+    return calcOutsFitness(outs.data());
+}
+
+static void calcParamsSamplesFitness(const Tensor& params, size_t s0, size_t s1, double* pFits)
+{
+    auto& st = getThreadState();
+    st.mNet.LoadParams(params);
+
+    const auto n = s1 - s0;
+    auto ins  = Tensor(n, LAYER_NS.front(), st.mIns.data(), false);
+    auto outs = Tensor(n, LAYER_NS.back(), st.mOuts.data(), false);
+    for (size_t i=0; i < n; ++i)
+        fillSampleIns(ins[i], s0 + i);
+
+    st.mNet.ForwardPassBatch(outs, ins);
+    for (size_t i=0; i < n; ++i)
+        pFits[i] = calcOutsFitness(outs[i]);
+}
+
+//==================================================================
+// allocations in the last of epochsN epochs
+static size_t runTraining(bool useBatch, size_t epochsN)
+{
+    TrainingManager::Params par;
+    par.layerNs = LAYER_NS;
+    par.maxEpochsN = epochsN;
+    par.samplesN = SAMPLES_N;
+    par.useRacing = true;
+    par.batchTileN = BATCH_TILE_N;
+    par.calcFitnessFn = [](const SimpleNN& net, size_t sidx, std::atomic<bool>&)
+    {
+        return calcNetSampleFitness(net, sidx);
+    };
+    if (useBatch)
+    {
+        par.calcFitnessBatchFn = [](const Tensor& params, size_t s0, size_t s1, double* pFits, std::atomic<bool>&)
+        {
+            calcParamsSamplesFitness(params, s0, s1, pFits);
+        };
+    }
+    par.initThreadFn = [](){ getThreadState(); };
+
+    TrainingManager tm(par);
+    tm.GetTrainerFuture().get();
+    return tm.GetLastEpochAllocsN();
+}
+
+//==================================================================
+int main()
+{
+    AllocCounter::sEnabled = true;
+
+    int failsN = 0;
+    for (const bool useBatch : {false, true})
+    {
+        for (const size_t epochsN : {2, 5})
+        {
+            const auto allocsN = runTraining(useBatch, epochsN);
+            const auto ok = allocsN == 0;
+            printf("%-12s epochs %zu, allocs in the last %zu %s\n",
+                    useBatch ? "batch" : "single", epochsN, allocsN, ok ? "OK" : "FAIL");
+            failsN += ok ? 0 : 1;
+        }
+    }
+
+    printf("%s\n", failsN ? "FAILED" : "PASSED");
+    return failsN ? 1 : 0;
+}